@@ -0,0 +1,435 @@
+/*
+   Benchmarks of the unufo healing core on synthetic workloads.
+
+   Prints one JSON object per line: microbenchmarks of the patch
+   primitives first, then end-to-end heal timings.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <algorithm>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "unufo_geometry.h"
+#include "unufo_patch.h"
+#include "unufo_random.h"
+#include "unufo_synth.h"
+#include "unufo_types.h"
+
+using namespace std;
+using namespace unufo;
+
+// all workloads are generated from this seed, so every run measures the same work
+static const uint64_t workload_seed = 20110101;
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+/* Synthetic workloads */
+
+enum texture_kind { TEXTURE_NOISE, TEXTURE_STRIPES, TEXTURE_BRICKS };
+static const char* const texture_names[] = {"noise", "stripes", "bricks"};
+
+enum mask_kind { MASK_BOX, MASK_DISC, MASK_STROKE, MASK_SPOTS };
+static const char* const mask_names[] = {"box", "disc", "stroke", "spots"};
+
+// texture of bpp channels, the last one is an opaque alpha for 2 and 4
+static void make_texture(Bitmap<uint8_t>& image, int width, int height, texture_kind kind, int bpp)
+{
+    random_generator random(workload_seed, kind);
+    int colors = bpp == 2 || bpp == 4 ? bpp - 1 : bpp;
+    image.resize(width, height, bpp);
+    for (int y=0; y<height; ++y)
+        for (int x=0; x<width; ++x) {
+            uint8_t* pixel = image.at(x, y);
+            int noise = random.below(32);
+            for (int j=0; j<colors; ++j) {
+                int value;
+                switch (kind) {
+                case TEXTURE_STRIPES:
+                    value = 128 + int(90*sin((x + 2*y)*0.15 + j));
+                    break;
+                case TEXTURE_BRICKS: {
+                    int row = y/12;
+                    bool mortar = y%12 < 2 || (x + (row%2)*16)%32 < 2;
+                    value = mortar ? 200 : 90 + 40*j + (row*37 + (x + (row%2)*16)/32*53)%40;
+                    break;
+                }
+                default:
+                    value = random.below(256);
+                }
+                pixel[j] = max(0, min(255, value + noise - 16));
+            }
+            if (colors < bpp)
+                pixel[colors] = 255;
+        }
+}
+
+static void make_mask(Bitmap<uint8_t>& mask, int width, int height, mask_kind kind, int size)
+{
+    mask.resize(width, height, 1);
+    int cx = width/2, cy = height/2;
+    for (int y=0; y<height; ++y)
+        for (int x=0; x<width; ++x) {
+            bool inside;
+            switch (kind) {
+            case MASK_DISC:
+                inside = (x - cx)*(x - cx) + (y - cy)*(y - cy) < size*size/4;
+                break;
+            case MASK_SPOTS: {
+                // grid of small discs like dust, size across and 4*size apart,
+                // with every other row shifted
+                int spacing = 4*size;
+                int sx = (x + (y/spacing%2)*spacing/2)%spacing - spacing/2;
+                int sy = y%spacing - spacing/2;
+                inside = sx*sx + sy*sy < size*size/4;
+                break;
+            }
+            case MASK_STROKE: {
+                // thick diagonal line across the middle
+                int along = (x - cx) + (y - cy);
+                int across = (x - cx) - (y - cy);
+                inside = abs(along) < size && abs(across) < size/8 + 2;
+                break;
+            }
+            default:
+                inside = abs(x - cx) < size/2 && abs(y - cy) < size/2;
+            }
+            mask.at(x, y)[0] = inside ? 255 : 0;
+        }
+}
+
+/* Microbenchmarks */
+
+// image with a disc shaped hole which is partly filled,
+// and the pairs of points the primitives are measured on
+struct micro_workload
+{
+    Bitmap<uint8_t> data;
+    StateMap states;
+    Matrix<int> transfer_belief;
+    BitPlane defined;
+    vector<Coordinates> positions, candidates;
+};
+
+static void make_micro_workload(micro_workload& w, int comp_size, int bpp)
+{
+    const int size = 256, pairs = 4096;
+    random_generator random(workload_seed, 100 + comp_size);
+
+    make_texture(w.data, size, size, TEXTURE_BRICKS, bpp);
+    w.states.resize(size, size);
+    w.transfer_belief.resize(size, size);
+    w.defined.resize(size, size);
+
+    vector<Coordinates> known, unknown;
+    for (int y=0; y<size; ++y)
+        for (int x=0; x<size; ++x) {
+            int r2 = (x - size/2)*(x - size/2) + (y - size/2)*(y - size/2);
+            // outer ring of the hole is already filled
+            bool hole = r2 < 64*64;
+            bool filled = hole && r2 >= 48*48;
+            *w.transfer_belief.at(x, y) = hole && !filled ? -1 : (filled ? 1000 : 0);
+            if (!hole || filled)
+                w.defined.set(Coordinates(x, y));
+            w.states.at(x, y)->confidence = hole && !filled ? 0 : 255;
+            w.states.at(x, y)->flags = hole ? point_selected : 0;
+            if (hole && !filled && r2 >= 40*40)
+                unknown.push_back(Coordinates(x, y));
+            else if (!hole && x >= comp_size && y >= comp_size &&
+                     x < size - comp_size && y < size - comp_size)
+                known.push_back(Coordinates(x, y));
+        }
+
+    for (int i=0; i<pairs; ++i) {
+        w.positions.push_back(unknown[random.below(unknown.size())]);
+        w.candidates.push_back(known[random.below(known.size())]);
+    }
+}
+
+static double min_seconds = 0.25;
+
+// run op over all pairs until min_seconds passed, return ns per call
+template<class Op>
+static double measure(const micro_workload& w, Op op, long& calls)
+{
+    calls = 0;
+    double start = now(), elapsed;
+    do {
+        for (size_t i=0; i<w.positions.size(); ++i)
+            op(w.positions[i], w.candidates[i]);
+        calls += w.positions.size();
+        elapsed = now() - start;
+    } while (elapsed < min_seconds);
+    return elapsed*1e9/calls;
+}
+
+// keeps results alive so the compiler can't drop the calls
+static volatile int sink;
+
+static void report_micro(const char* name, int comp_size, int bpp, double ns, long calls)
+{
+    printf("{\"suite\": \"micro\", \"name\": \"%s\", \"comp_size\": %d, \"bpp\": %d, "
+           "\"calls\": %ld, \"ns_per_call\": %.1f}\n",
+           name, comp_size, bpp, calls, ns);
+    fflush(stdout);
+}
+
+static void run_micro(int comp_size, int bpp)
+{
+    micro_workload w;
+    make_micro_workload(w, comp_size, bpp);
+    difference_counters counters;
+    vector<int> color_diff(4, 0);
+    long calls;
+    double ns;
+
+    ns = measure(w, [&](const Coordinates& p, const Coordinates& c) {
+        sink = get_difference(w.data, w.defined, comp_size, c, p, INT_MAX, counters);
+    }, calls);
+    report_micro("get_difference", comp_size, bpp, ns, calls);
+
+    // a bound typical for the global search lets most candidates be pruned
+    vector<int> differences;
+    for (size_t i=0; i<w.positions.size(); ++i)
+        differences.push_back(get_difference(w.data, w.defined, comp_size,
+                w.candidates[i], w.positions[i], INT_MAX, counters));
+    nth_element(differences.begin(), differences.begin() + differences.size()/10, differences.end());
+    int bound = differences[differences.size()/10];
+    ns = measure(w, [&](const Coordinates& p, const Coordinates& c) {
+        sink = get_difference(w.data, w.defined, comp_size, c, p, bound, counters);
+    }, calls);
+    report_micro("get_difference_bounded", comp_size, bpp, ns, calls);
+
+    ns = measure(w, [&](const Coordinates& p, const Coordinates& c) {
+        sink = get_difference_color_adjustment(w.data, w.defined, comp_size,
+                c, p, color_diff, INT_MAX, bpp, 20, false, counters);
+    }, calls);
+    report_micro("get_difference_color_adjustment", comp_size, bpp, ns, calls);
+
+    vector<uint8_t> def_n_p(bpp*(2*comp_size + 1)*(2*comp_size + 1));
+    vector<uint8_t> def_n_c(def_n_p.size());
+    ns = measure(w, [&](const Coordinates& p, const Coordinates& c) {
+        int defined_only_near_pos;
+        sink = collect_defined_in_both_areas(w.data, w.defined, p, c, comp_size,
+                &def_n_p[0], &def_n_c[0], defined_only_near_pos);
+    }, calls);
+    report_micro("collect_defined_in_both_areas", comp_size, bpp, ns, calls);
+
+    ns = measure(w, [&](const Coordinates& p, const Coordinates&) {
+        sink = get_complexity(w.data, w.states, w.defined, p, comp_size, bpp);
+    }, calls);
+    report_micro("get_complexity", comp_size, bpp, ns, calls);
+
+    // the same functions specialized for comp_size and bpp, as synthesize() uses them
+    patch_kernels kernels = select_patch_kernels(comp_size, bpp);
+    ns = measure(w, [&](const Coordinates& p, const Coordinates& c) {
+        sink = kernels.difference(w.data, w.defined, comp_size, c, p, INT_MAX, counters);
+    }, calls);
+    report_micro("patch_kernels.difference", comp_size, bpp, ns, calls);
+
+    ns = measure(w, [&](const Coordinates& p, const Coordinates& c) {
+        sink = kernels.difference(w.data, w.defined, comp_size, c, p, bound, counters);
+    }, calls);
+    report_micro("patch_kernels.difference_bounded", comp_size, bpp, ns, calls);
+
+    ns = measure(w, [&](const Coordinates& p, const Coordinates& c) {
+        sink = kernels.difference_color_adjustment(w.data, w.defined, comp_size,
+                c, p, color_diff, INT_MAX, bpp, 20, false, counters);
+    }, calls);
+    report_micro("patch_kernels.difference_color_adjustment", comp_size, bpp, ns, calls);
+
+    ns = measure(w, [&](const Coordinates& p, const Coordinates&) {
+        sink = kernels.complexity(w.data, w.states, w.defined, p, comp_size, bpp);
+    }, calls);
+    report_micro("patch_kernels.complexity", comp_size, bpp, ns, calls);
+
+    // transfer_patch writes, leave the beliefs as they are
+    ns = measure(w, [&](const Coordinates& p, const Coordinates& c) {
+        int belief = *w.transfer_belief.at(p);
+        transfer_patch(w.data, bpp, w.states, w.transfer_belief, w.defined,
+                p, c, belief, color_diff);
+    }, calls);
+    report_micro("transfer_patch", comp_size, bpp, ns, calls);
+}
+
+/* End-to-end heal timings */
+
+struct heal_workload
+{
+    int width, height;
+    texture_kind texture;
+    mask_kind mask;
+    int mask_size;
+    int comp_size, tries, pyramid_levels, ann_candidates;
+    bool split_components;
+    int time_budget_ms;
+    bool warm_start;
+};
+
+static const heal_workload heal_workloads[] = {
+    // width height texture          mask         size comp tries levels ann split budget warm
+    {256, 256, TEXTURE_STRIPES, MASK_BOX,     48,  3, 20, 1, 0, false,   0, false},
+    {640, 480, TEXTURE_NOISE,   MASK_DISC,    96,  3, 20, 1, 0, false,   0, false},
+    {640, 480, TEXTURE_BRICKS,  MASK_STROKE, 160,  2, 50, 1, 0, false,   0, false},
+    {640, 480, TEXTURE_BRICKS,  MASK_DISC,    96,  5, 20, 1, 0, false,   0, false},
+    {640, 480, TEXTURE_BRICKS,  MASK_DISC,    96,  5, 20, 1, 0, false, 100, false},
+    {640, 480, TEXTURE_BRICKS,  MASK_DISC,    96,  5, 20, 1, 0, false,   0, true},
+    {640, 480, TEXTURE_STRIPES, MASK_DISC,   160,  3, 20, 3, 0, false,   0, false},
+    {640, 480, TEXTURE_BRICKS,  MASK_BOX,    128,  3, 20, 1, 8, false,   0, false},
+    {640, 480, TEXTURE_NOISE,   MASK_SPOTS,   12,  3, 20, 1, 0, false,   0, false},
+    {640, 480, TEXTURE_NOISE,   MASK_SPOTS,   12,  3, 20, 1, 0, true,    0, false},
+};
+
+static void run_heal(const heal_workload& w, int threads, int repeats)
+{
+    Bitmap<uint8_t> texture, mask;
+    make_texture(texture, w.width, w.height, w.texture, 3);
+    make_mask(mask, w.width, w.height, w.mask, w.mask_size);
+
+    Parameters parameters;
+    parameters.corpus_id        = -1;
+    parameters.neighbours       = 0;
+    parameters.tries            = w.tries;
+    parameters.comp_size        = w.comp_size;
+    parameters.transfer_size    = 2;
+    parameters.invent_gradients = false;
+    parameters.max_adjustment   = 0;
+    parameters.equal_adjustment = false;
+    parameters.use_ref_layer    = false;
+    parameters.threads          = threads;
+    parameters.parallel_refinement = false;
+    parameters.pyramid_levels   = w.pyramid_levels;
+    parameters.ann_candidates   = w.ann_candidates;
+    parameters.seed             = 1;
+    parameters.split_components = w.split_components;
+    parameters.time_budget_ms   = w.time_budget_ms;
+
+    Rectangle selection(w.width, w.height, 0, 0);
+    int points = 0;
+    for (int y=0; y<w.height; ++y)
+        for (int x=0; x<w.width; ++x)
+            if (mask.at(x, y)[0]) {
+                selection.x1 = min(selection.x1, x);
+                selection.y1 = min(selection.y1, y);
+                selection.x2 = max(selection.x2, x + 1);
+                selection.y2 = max(selection.y2, y + 1);
+                ++points;
+            }
+
+    // like the command line driver with its default border
+    const int border = 50;
+    int corpus_width  = min(selection.x2 + border, w.width)  - max(selection.x1 - border, 0);
+    int corpus_height = min(selection.y2 + border, w.height) - max(selection.y1 - border, 0);
+    Rectangle corpus = corpus_region(parameters, w.width, w.height,
+            corpus_width, corpus_height, selection);
+
+    // one context for all repeats, like a service healing image after image
+    synthesis_context context;
+    context.configure(parameters, 3);
+
+    Rectangle whole(0, 0, w.width, w.height);
+
+    // re-runs start from the field of an untimed first run
+    source_field initial;
+    if (w.warm_start) {
+        Bitmap<uint8_t> image, image_mask;
+        image.crop_from(texture, whole);
+        image_mask.crop_from(mask, whole);
+        context.run(image, image_mask, NULL, selection, corpus);
+        initial = context.field();
+    }
+
+    vector<double> seconds;
+    for (int i=0; i<repeats; ++i) {
+        Bitmap<uint8_t> image, image_mask;
+        image.crop_from(texture, whole);
+        image_mask.crop_from(mask, whole);
+        double start = now();
+        context.run(image, image_mask, NULL, selection, corpus, w.warm_start ? &initial : NULL);
+        seconds.push_back(now() - start);
+    }
+    sort(seconds.begin(), seconds.end());
+
+    printf("{\"suite\": \"heal\", \"name\": \"%s-%s-%dx%d\", \"points\": %d, "
+           "\"comp_size\": %d, \"tries\": %d, \"pyramid_levels\": %d, \"ann_candidates\": %d, "
+           "\"split_components\": %s, \"time_budget_ms\": %d, \"warm_start\": %s, "
+           "\"threads\": %d, \"repeats\": %d, \"seconds_min\": %.4f, \"seconds_median\": %.4f, "
+           "\"total_belief\": %" PRId64 "}\n",
+           texture_names[w.texture], mask_names[w.mask], w.width, w.height, points,
+           w.comp_size, w.tries, w.pyramid_levels, w.ann_candidates,
+           w.split_components ? "true" : "false", w.time_budget_ms,
+           w.warm_start ? "true" : "false",
+           threads, repeats, seconds.front(), seconds[seconds.size()/2],
+           context.stats().total_belief);
+    fflush(stdout);
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "\n"
+        "Runs the benchmarks and prints one JSON object per result line.\n"
+        "\n"
+        "options:\n"
+        "  -q            quick run: shorter measurements, one heal repeat\n"
+        "  -m            microbenchmarks only\n"
+        "  -e            end-to-end heal timings only\n"
+        "  -j threads    number of search threads for heal timings (default: one per core)\n",
+        argv0);
+}
+
+int main(int argc, char** argv)
+{
+    int repeats = 3;
+    int threads = 0;
+    bool micro = true, heal = true;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "qmej:h")) != -1) {
+        switch (opt) {
+        case 'q': min_seconds = 0.02; repeats = 1; break;
+        case 'm': heal = false; break;
+        case 'e': micro = false; break;
+        case 'j': threads = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (micro) {
+        // grayscale and RGB
+        static const int comp_sizes[] = {2, 3, 5, 10};
+        static const int bpps[] = {1, 3};
+        for (size_t k=0; k<sizeof(bpps)/sizeof(bpps[0]); ++k)
+            for (size_t i=0; i<sizeof(comp_sizes)/sizeof(comp_sizes[0]); ++i)
+                run_micro(comp_sizes[i], bpps[k]);
+    }
+
+    if (heal)
+        for (size_t i=0; i<sizeof(heal_workloads)/sizeof(heal_workloads[0]); ++i)
+            run_heal(heal_workloads[i], threads, repeats);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,686 @@
+/*
+   Regression checks of the unufo healing core.
+
+   Prints one line per failed check, exits with failure if there was any.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "unufo_kernels.h"
+#include "unufo_motion.h"
+#include "unufo_patch.h"
+#include "unufo_pixel.h"
+#include "unufo_pnm.h"
+#include "unufo_random.h"
+#include "unufo_sidecar.h"
+#include "unufo_synth.h"
+#include "unufo_thread_pool.h"
+#include "unufo_types.h"
+
+using namespace unufo;
+
+static int failures = 0;
+
+static void check(bool condition, const char* what, int bpp)
+{
+    if (!condition) {
+        printf("FAILED: %s (bpp %d)\n", what, bpp);
+        ++failures;
+    }
+}
+
+static void make_parameters(Parameters& parameters)
+{
+    parameters.corpus_id        = -1;
+    parameters.neighbours       = 0;
+    parameters.tries            = 20;
+    parameters.comp_size        = 3;
+    parameters.transfer_size    = 2;
+    parameters.invent_gradients = false;
+    parameters.max_adjustment   = 0;
+    parameters.equal_adjustment = false;
+    parameters.use_ref_layer    = false;
+    parameters.threads          = 0;
+    parameters.parallel_refinement = false;
+    parameters.pyramid_levels   = 1;
+    parameters.ann_candidates   = 0;
+    parameters.seed             = 1;
+    parameters.split_components = false;
+    parameters.time_budget_ms   = 0;
+}
+
+// noisy stripes in a width x height image and a square hole in its middle
+static void make_job(int width, int height, int bpp, int hole,
+        Bitmap<uint8_t>& image, Bitmap<uint8_t>& mask, Rectangle& selection)
+{
+    random_generator random(bpp);
+    image.resize(width, height, bpp);
+    mask.resize(width, height, 1);
+    for (int y=0; y<height; ++y)
+        for (int x=0; x<width; ++x)
+            for (int c=0; c<bpp; ++c)
+                image.at(x, y)[c] = (x + 2*y + 40*c)%32*6 + random.below(32);
+
+    selection = Rectangle((width - hole)/2, (height - hole)/2,
+            (width + hole)/2, (height + hole)/2);
+    for (int y=selection.y1; y<selection.y2; ++y)
+        for (int x=selection.x1; x<selection.x2; ++x)
+            mask.at(x, y)[0] = 255;
+}
+
+// a heal started from a field which seeds every point has nothing left
+// for the fill loop, only refinement runs
+static void check_fully_seeded_rerun(int bpp)
+{
+    const int width = 128, height = 128, hole = 32;
+    Bitmap<uint8_t> original, original_mask, image, mask;
+    Rectangle selection;
+    make_job(width, height, bpp, hole, original, original_mask, selection);
+    Rectangle whole(0, 0, width, height);
+    Rectangle corpus(3, 3, width - 4, height - 4);
+
+    Parameters parameters;
+    make_parameters(parameters);
+    synthesis_context context;
+    context.configure(parameters, bpp);
+
+    // every point taken from the ground truth right of the hole
+    source_field initial;
+    initial.reset(selection);
+    for (int y=selection.y1; y<selection.y2; ++y)
+        for (int x=selection.x1; x<selection.x2; ++x)
+            initial.at(Coordinates(x, y)) = Coordinates(x + hole + 8, y);
+
+    image.crop_from(original, whole);
+    mask.crop_from(original_mask, whole);
+    check(context.run(image, mask, NULL, selection, corpus, &initial),
+            "run seeded from a complete field", bpp);
+    check(context.stats().seeded_points == hole*hole,
+            "every point seeded from a complete field", bpp);
+    check(context.stats().iterations.empty(),
+            "no fill loop iterations when every point is seeded", bpp);
+
+    // like re-running a -w heal, from the field the previous run left
+    source_field previous = context.field();
+    image.crop_from(original, whole);
+    mask.crop_from(original_mask, whole);
+    check(context.run(image, mask, NULL, selection, corpus, &previous),
+            "rerun from the field of the previous run", bpp);
+}
+
+// runs without points to take patches from fail instead of searching forever
+static void check_no_sources(int bpp)
+{
+    Parameters parameters;
+    make_parameters(parameters);
+    synthesis_context context;
+    context.configure(parameters, bpp);
+
+    // no point of a 3x3 image is a patch radius away from its borders
+    Bitmap<uint8_t> image, mask;
+    Rectangle selection;
+    make_job(3, 3, bpp, 1, image, mask, selection);
+    check(!context.run(image, mask, NULL, selection, Rectangle(0, 0, 3, 3), NULL),
+            "image smaller than a patch", bpp);
+
+    // only the first column is known, outside of the corpus
+    make_job(64, 64, bpp, 64, image, mask, selection);
+    for (int y=0; y<64; ++y)
+        mask.at(0, y)[0] = 0;
+    check(!context.run(image, mask, NULL, selection, Rectangle(0, 0, 64, 64), NULL),
+            "corpus without unmasked points", bpp);
+}
+
+// points the fill loops of a run filled at full resolution
+static int filled_points(const synthesis_stats& stats)
+{
+    int filled = 0;
+    for (size_t i=0; i<stats.levels.size(); ++i)
+        if (!stats.levels[i].level)
+            filled += stats.levels[i].points - stats.levels[i].points_left;
+    return filled;
+}
+
+// a selection of one large and several small spots fills as many points
+// split into components as filled as a whole, and the same image on any
+// number of threads, the large spot running alone on the whole pool
+static void check_split_components(int bpp)
+{
+    const int width = 192, height = 192;
+    Bitmap<uint8_t> original, original_mask;
+    Rectangle selection;
+    make_job(width, height, bpp, 48, original, original_mask, selection);
+    for (int i=0; i<6; ++i)
+        for (int y=20; y<26; ++y)
+            for (int x=20 + 25*i; x<26 + 25*i; ++x)
+                original_mask.at(x, y)[0] = 255;
+    selection = Rectangle(20, 20, 171, (height + 48)/2);
+    Rectangle whole(0, 0, width, height);
+    Rectangle corpus(3, 3, width - 4, height - 4);
+    int masked = 0;
+    for (int y=0; y<height; ++y)
+        for (int x=0; x<width; ++x)
+            masked += original_mask.at(x, y)[0] != 0;
+
+    const bool split[3] = {false, true, true};
+    const int threads[3] = {1, 1, 4};
+    Bitmap<uint8_t> results[3];
+    int filled[3];
+    for (int i=0; i<3; ++i) {
+        Parameters parameters;
+        make_parameters(parameters);
+        parameters.split_components = split[i];
+        parameters.threads = threads[i];
+        synthesis_context context;
+        context.configure(parameters, bpp);
+
+        Bitmap<uint8_t> mask;
+        results[i].crop_from(original, whole);
+        mask.crop_from(original_mask, whole);
+        check(context.run(results[i], mask, NULL, selection, corpus, NULL),
+                "run on spots", bpp);
+        filled[i] = filled_points(context.stats());
+        if (split[i])
+            check(context.stats().components == 7, "spots split into components", bpp);
+    }
+    check(filled[0] == masked, "every spot filled as a whole", bpp);
+    check(filled[1] == filled[0] && filled[2] == filled[0],
+            "split spots fill as many points as filled as a whole", bpp);
+    check(!memcmp(results[1].data, results[2].data, width*height*bpp),
+            "split spots on 1 and 4 threads give the same image", bpp);
+}
+
+// total refinement passes of a run
+static uint64_t refine_runs(const synthesis_stats& stats)
+{
+    uint64_t runs = 0;
+    for (size_t i=0; i<stats.passes.size(); ++i)
+        runs += stats.passes[i].runs;
+    return runs;
+}
+
+// the second of two frames, its content moved, starts from the field of
+// the first shifted by the estimated motion, like the -f sequence mode
+static void check_sequence(int bpp)
+{
+    const int width = 128, height = 128, hole = 32, shift = 3;
+    Bitmap<uint8_t> first, first_mask, second, second_mask;
+    Rectangle selection;
+    make_job(width, height, bpp, hole, first, first_mask, selection);
+    Rectangle whole(0, 0, width, height);
+    Rectangle corpus(3, 3, width - 4, height - 4);
+
+    // second frame: the scene panned right under a static mask
+    Bitmap<uint8_t> scene;
+    make_job(width, height, bpp, hole, scene, second_mask, selection);
+    second.resize(width, height, bpp);
+    for (int y=0; y<height; ++y)
+        for (int x=0; x<width; ++x)
+            memcpy(second.at(x, y), scene.at(std::max(x - shift, 0), y), bpp);
+
+    Parameters parameters;
+    make_parameters(parameters);
+    synthesis_context context;
+    context.configure(parameters, bpp);
+    check(context.run(first, first_mask, NULL, selection, corpus, NULL),
+            "first frame", bpp);
+    Bitmap<uint8_t> mask;
+    mask.crop_from(second_mask, whole);
+
+    Coordinates motion = estimate_motion(first, Coordinates(), second, mask, Coordinates(), 16);
+    check(motion.x == shift && motion.y == 0, "motion between the frames", bpp);
+    source_field initial = context.field();
+    initial.translate(motion.x, motion.y);
+
+    Bitmap<uint8_t> cold_image, cold_mask;
+    cold_image.crop_from(second, whole);
+    cold_mask.crop_from(second_mask, whole);
+    synthesis_context cold;
+    cold.configure(parameters, bpp);
+    check(cold.run(cold_image, cold_mask, NULL, selection, corpus, NULL),
+            "second frame cold", bpp);
+
+    check(context.run(second, mask, NULL, selection, corpus, &initial),
+            "second frame from the first", bpp);
+    check(context.stats().seeded_points >= hole*hole*3/4,
+            "second frame seeded from the first", bpp);
+    check(refine_runs(context.stats()) < refine_runs(cold.stats()),
+            "second frame needs fewer refinement passes than a cold start", bpp);
+}
+
+// parallel refinement gives the same result on any number of threads
+static void check_parallel_refinement(int bpp)
+{
+    // a hole of several tiles in every phase
+    const int width = 256, height = 256, hole = 160;
+    Bitmap<uint8_t> original, original_mask;
+    Rectangle selection;
+    make_job(width, height, bpp, hole, original, original_mask, selection);
+    Rectangle whole(0, 0, width, height);
+    Rectangle corpus(3, 3, width - 4, height - 4);
+
+    Bitmap<uint8_t> results[2];
+    const int threads[2] = {1, 8};
+    for (int i=0; i<2; ++i) {
+        Parameters parameters;
+        make_parameters(parameters);
+        parameters.parallel_refinement = true;
+        parameters.threads = threads[i];
+        synthesis_context context;
+        context.configure(parameters, bpp);
+
+        Bitmap<uint8_t> mask;
+        results[i].crop_from(original, whole);
+        mask.crop_from(original_mask, whole);
+        check(context.run(results[i], mask, NULL, selection, corpus, NULL),
+                "parallel refinement run", bpp);
+    }
+    check(!memcmp(results[0].data, results[1].data, width*height*bpp),
+            "parallel refinement on 1 and 8 threads gives the same image", bpp);
+}
+
+// component jobs rely on loops nested in the tasks of a pooled loop
+// running serially on the thread of their task
+// pixels of the patches around position and candidate that are inside
+// the image, four channels each with the ones past bpp read as 0, as
+// the kernels must see them
+struct patch_pairs
+{
+    std::vector<int> pos, cand;
+    int undefined;
+};
+
+static void collect_pairs(const Bitmap<uint8_t>& data, const BitPlane& defined,
+        int radius, const Coordinates& position, const Coordinates& candidate,
+        patch_pairs& pairs)
+{
+    pairs.pos.clear();
+    pairs.cand.clear();
+    pairs.undefined = 0;
+    for (int oy=-radius; oy<=radius; ++oy)
+        for (int ox=-radius; ox<=radius; ++ox) {
+            Coordinates p = position + Coordinates(ox, oy), c = candidate + Coordinates(ox, oy);
+            if (std::min(p.x, c.x) < 0 || std::min(p.y, c.y) < 0 ||
+                std::max(p.x, c.x) >= data.width || std::max(p.y, c.y) >= data.height)
+                continue;
+            if (!defined.get(c)) {
+                ++pairs.undefined;
+                continue;
+            }
+            if (!defined.get(p))
+                continue;
+            for (int j=0; j<4; ++j) {
+                pairs.pos.push_back(j < data.depth ? data.at(p)[j] : 0);
+                pairs.cand.push_back(j < data.depth ? data.at(c)[j] : 0);
+            }
+        }
+}
+
+// get_difference without kernels or pruning
+static int reference_difference(const patch_pairs& pairs, int best)
+{
+    if (pairs.pos.empty())
+        return best;
+    int sum = pairs.undefined*max_diff;
+    for (size_t i=0; i<pairs.pos.size(); ++i)
+        sum += (pairs.pos[i] - pairs.cand[i])*(pairs.pos[i] - pairs.cand[i]);
+    return sum;
+}
+
+// get_difference_color_adjustment without kernels or pruning
+static int reference_difference_color_adjustment(const patch_pairs& pairs,
+        std::vector<int>& best_color_diff, int best, int bpp,
+        int max_adjustment, bool equal_adjustment)
+{
+    int compared = pairs.pos.size()/4;
+    if (!compared)
+        return best;
+
+    int accum[4] = {0, 0, 0, 0};
+    for (size_t i=0; i<pairs.pos.size(); ++i)
+        accum[i%4] += pairs.pos[i] - pairs.cand[i];
+    for (int j=0; j<4; ++j)
+        accum[j] = std::max(-max_adjustment, std::min(max_adjustment, accum[j]/compared));
+    if (equal_adjustment) {
+        int color_diff_sum = accum[0] + accum[1] + accum[2] + accum[3];
+        for (int j=0; j<4; ++j)
+            accum[j] = color_diff_sum/bpp;
+    }
+
+    int sum = pairs.undefined*max_diff;
+    for (size_t i=0; i<pairs.pos.size(); ++i) {
+        int c = pairs.cand[i] + accum[i%4];
+        if (c < 0 || c > 255)
+            return best;
+        sum += (pairs.pos[i] - c)*(pairs.pos[i] - c);
+    }
+    if (sum < best)
+        best_color_diff.assign(accum, accum + bpp);
+    return sum;
+}
+
+// a result for bound is right if it is exact, or if it is at least bound
+// and at most the exact difference, which pruned comparisons return
+static bool same_difference(int result, int exact, int bound)
+{
+    return result == exact || (bound <= result && result <= exact);
+}
+
+// the selected and the generic comparison functions against the references
+// on random patches, whole and clipped at the border, of partially defined
+// images, with unlimited and finite bounds
+static int compare_differences(int radius, int bpp, random_generator& random)
+{
+    const int width = 48, height = 40, trials = 400;
+    Bitmap<uint8_t> data;
+    data.resize(width, height, bpp);
+    BitPlane defined;
+    defined.resize(width, height);
+    // mid-range channels so that color adjustment rarely clips
+    for (int i=0; i<width*height*bpp; ++i)
+        data.data[i] = 48 + random.below(160);
+    int undefined_percent = random.below(2) ? 10 : 40;
+    for (int y=0; y<height; ++y)
+        for (int x=0; x<width; ++x)
+            if (random.below(100) >= undefined_percent)
+                defined.set(Coordinates(x, y));
+
+    patch_kernels selected = select_patch_kernels(radius, bpp);
+    patch_pairs pairs;
+    int mismatches = 0;
+    for (int t=0; t<trials; ++t) {
+        Coordinates position(random.below(width), random.below(height));
+        Coordinates candidate(random.below(width), random.below(height));
+        collect_pairs(data, defined, radius, position, candidate, pairs);
+
+        int exact = reference_difference(pairs, INT_MAX);
+        int bound = t%2 ? INT_MAX : random.below(exact < INT_MAX/2 ? 2*exact + 1 : INT_MAX);
+        int max_adjustment = t%3 ? 64 : 255;
+        bool equal_adjustment = t%5 == 0;
+
+        difference_counters counters;
+        exact = reference_difference(pairs, bound);
+        if (!same_difference(selected.difference(data, defined, radius,
+                    candidate, position, bound, counters), exact, bound) ||
+            !same_difference(get_difference(data, defined, radius,
+                    candidate, position, bound, counters), exact, bound))
+            ++mismatches;
+
+        std::vector<int> exact_diff(bpp, 7), selected_diff(bpp, 7), generic_diff(bpp, 7);
+        exact = reference_difference_color_adjustment(pairs, exact_diff, bound, bpp,
+                max_adjustment, equal_adjustment);
+        int selected_result = selected.difference_color_adjustment(data, defined, radius,
+                candidate, position, selected_diff, bound, bpp,
+                max_adjustment, equal_adjustment, counters);
+        int generic_result = get_difference_color_adjustment(data, defined, radius,
+                candidate, position, generic_diff, bound, bpp,
+                max_adjustment, equal_adjustment, counters);
+        if (!same_difference(selected_result, exact, bound) ||
+            !same_difference(generic_result, exact, bound))
+            ++mismatches;
+        // the adjustment is reported along with a difference below bound
+        else if (exact < bound && (selected_diff != exact_diff || generic_diff != exact_diff))
+            ++mismatches;
+    }
+    return mismatches;
+}
+
+static void check_kernels()
+{
+    const kernel_isa isas[] = {kernels_generic, kernels_sse2, kernels_avx2};
+    const char* isa_names[] = {"generic", "SSE2", "AVX2"};
+    const int radii[] = {1, 2, 3, 5, 10};
+    random_generator random(17);
+    for (int i=0; i<3; ++i) {
+        if (!use_kernels(isas[i])) {
+            printf("skipped: %s kernels, not supported\n", isa_names[i]);
+            continue;
+        }
+        for (int r=0; r<5; ++r)
+            for (int bpp=1; bpp<=4; ++bpp) {
+                char what[80];
+                snprintf(what, sizeof(what), "%s kernels match the reference, comp_size %d",
+                        isa_names[i], radii[r]);
+                check(!compare_differences(radii[r], bpp, random), what, bpp);
+            }
+    }
+    use_kernels(fastest_kernel_isa());
+}
+
+static void check_nested_loops()
+{
+    thread_pool pool(4);
+    const int outer = 8, inner = 16;
+    std::vector<std::thread::id> outer_ids(outer), inner_ids(outer*inner);
+    pool.parallel_for(outer, [&](int i) {
+        outer_ids[i] = std::this_thread::get_id();
+        pool.parallel_for(inner, [&](int j) {
+            inner_ids[i*inner + j] = std::this_thread::get_id();
+        });
+    });
+
+    bool serial = true;
+    for (int i=0; i<outer*inner; ++i)
+        serial = serial && inner_ids[i] == outer_ids[i/inner];
+    check(serial, "nested loops run on the thread of their task", 0);
+
+    // the pool is free for the next loop afterwards
+    std::vector<int> done(inner, 0);
+    pool.parallel_for(inner, [&](int j) { done[j] = 1; });
+    int count = 0;
+    for (int j=0; j<inner; ++j)
+        count += done[j];
+    check(count == inner, "loop after nested loops", 0);
+}
+
+// true once count tasks have arrived, false if they don't within a few
+// seconds, which is what tasks run one after another see
+static bool meet(std::atomic<int>& arrived, int count)
+{
+    ++arrived;
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (arrived < count) {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+static void check_concurrent_loops()
+{
+    // a loop on another pool started from a task gets that pool's workers
+    thread_pool outer(2), inner(2);
+    std::atomic<int> arrived(0), met(0);
+    outer.parallel_for(2, [&](int i) {
+        if (i == 0)
+            inner.parallel_for(2, [&](int) { met += meet(arrived, 2); });
+    });
+    check(met == 2, "loop on another pool inside a task runs in parallel", 0);
+
+    // loops of concurrent callers both get the workers
+    thread_pool pool(2);
+    std::atomic<int> arrived_a(0), arrived_b(0), met_a(0), met_b(0);
+    std::thread a([&] {
+        pool.parallel_for(2, [&](int) { met_a += meet(arrived_a, 2); });
+    });
+    std::thread b([&] {
+        pool.parallel_for(2, [&](int) { met_b += meet(arrived_b, 2); });
+    });
+    a.join();
+    b.join();
+    check(met_a == 2 && met_b == 2, "loops of concurrent callers run in parallel", 0);
+}
+
+// a field written to a sidecar reads back only for the same image and heal,
+// with the fields in little endian order
+static void check_sidecar()
+{
+    const char* filename = "unufo_check.nnf";
+    const int width = 300, height = 200;
+    const Rectangle selection(40, 30, 90, 70), corpus(10, 0, 120, 100);
+    const uint64_t image_hash = 0x0123456789abcdefULL;
+
+    source_field field;
+    field.reset(Rectangle(35, 25, 95, 75));
+    random_generator random(24);
+    for (size_t i=0; i<field.sources.size(); ++i)
+        field.sources[i] = Coordinates(random.below(width), random.below(height));
+
+    if (!write_field_sidecar(filename, image_hash, width, height, selection, corpus, field)) {
+        check(false, "field sidecar written", 0);
+        return;
+    }
+
+    uint8_t head[20];
+    FILE* f = fopen(filename, "rb");
+    bool head_read = f && fread(head, sizeof(head), 1, f) == 1;
+    if (f)
+        fclose(f);
+    const uint8_t expected[20] = {'U', 'N', 'U', 'F', 'O', 'N', 'F', '2',
+        44, 1, 0, 0, 200, 0, 0, 0, 0xef, 0xcd, 0xab, 0x89};
+    check(head_read && !memcmp(head, expected, sizeof(expected)),
+            "field sidecar header is little endian", 0);
+
+    source_field back;
+    bool same = read_field_sidecar(filename, image_hash, width, height, selection, corpus, back) &&
+        back.bounds.x1 == field.bounds.x1 && back.bounds.y1 == field.bounds.y1 &&
+        back.bounds.x2 == field.bounds.x2 && back.bounds.y2 == field.bounds.y2;
+    for (size_t i=0; same && i<field.sources.size(); ++i)
+        same = back.sources[i].x == field.sources[i].x && back.sources[i].y == field.sources[i].y;
+    check(same, "field sidecar reads back", 0);
+
+    Rectangle other_selection(41, 30, 90, 70), other_corpus(10, 0, 120, 101);
+    check(!read_field_sidecar(filename, image_hash + 1, width, height, selection, corpus, back) &&
+            !read_field_sidecar(filename, image_hash, width, height, other_selection, corpus, back) &&
+            !read_field_sidecar(filename, image_hash, width, height, selection, other_corpus, back),
+            "field sidecar of another image or heal is ignored", 0);
+    remove(filename);
+}
+
+// header as write_pnm_patched() writes it
+static std::string pnm_header(int width, int height, int bpp)
+{
+    char header[128];
+    if (bpp == 1 || bpp == 3) {
+        snprintf(header, sizeof(header), "P%d\n%d %d\n255\n", bpp == 1 ? 5 : 6, width, height);
+    } else {
+        snprintf(header, sizeof(header),
+                "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+                width, height, bpp, bpp == 2 ? "GRAYSCALE_ALPHA" : "RGB_ALPHA");
+    }
+    return header;
+}
+
+static bool write_file(const char* filename, const std::string& content)
+{
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(content.data(), 1, content.size(), f) == content.size();
+    return !fclose(f) && ok;
+}
+
+static bool read_file(const char* filename, std::string& content)
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+        return false;
+    content.clear();
+    char block[4096];
+    size_t size;
+    while ((size = fread(block, 1, sizeof(block), f)) > 0)
+        content.append(block, size);
+    return !fclose(f);
+}
+
+// a window patched into an image, large enough to be copied in several
+// bands, gives the image with exactly those bytes replaced, also when the
+// image is patched in place
+static void check_pnm_patched(int bpp)
+{
+    const char* input = "unufo_check_in.pnm";
+    const char* output = "unufo_check_out.pnm";
+    const int width = 1400, height = 900;
+    random_generator random(19 + bpp);
+
+    std::string image = pnm_header(width, height, bpp);
+    size_t raster = image.size();
+    for (int i=0; i<width*height*bpp; ++i)
+        image += char(random.below(256));
+
+    for (int pass=0; pass<2; ++pass) {
+        // a window in the middle, then one at the bottom right corner
+        int x1 = pass ? width - 40 : 123, y1 = pass ? height - 500 : 77;
+        Bitmap<uint8_t> patch;
+        patch.resize(width - x1 < 300 ? width - x1 : 300, 500, bpp);
+        for (int i=0; i<patch.width*patch.height*bpp; ++i)
+            patch.data[i] = random.below(256);
+
+        std::string expected = image;
+        for (int y=0; y<patch.height; ++y)
+            memcpy(&expected[raster + (size_t(y1 + y)*width + x1)*bpp], patch.at(0, y),
+                    size_t(patch.width)*bpp);
+
+        // the second pass writes over the file it reads from
+        const char* target = pass ? input : output;
+        pnm_reader source;
+        std::string written;
+        bool ok = write_file(input, image) && source.open(input) &&
+            write_pnm_patched(target, source, patch, x1, y1);
+        source.close();
+        check(ok && read_file(target, written) && written == expected,
+                pass ? "window patched into a PNM in place" : "window patched into a PNM", bpp);
+    }
+    remove(input);
+    remove(output);
+}
+
+int main()
+{
+    check_kernels();
+    check_nested_loops();
+    check_sidecar();
+    check_pnm_patched(1);
+    check_pnm_patched(3);
+    check_pnm_patched(4);
+    check_concurrent_loops();
+
+    check_fully_seeded_rerun(1);
+    check_fully_seeded_rerun(3);
+    check_no_sources(1);
+    check_no_sources(3);
+    check_split_components(1);
+    check_split_components(3);
+    check_sequence(1);
+    check_sequence(3);
+    check_parallel_refinement(1);
+    check_parallel_refinement(3);
+
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("all checks passed\n");
+    return EXIT_SUCCESS;
+}
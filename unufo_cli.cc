@@ -0,0 +1,411 @@
+/*
+   Command line driver for the unufo healing core, no GIMP required.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+
+#include "unufo_motion.h"
+#include "unufo_pnm.h"
+#include "unufo_sidecar.h"
+#include "unufo_synth.h"
+#include "unufo_types.h"
+
+using namespace std;
+using namespace unufo;
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [options] image mask output [image mask output ...]\n"
+        "\n"
+        "Heals the points of image which are nonzero in the first channel of mask.\n"
+        "Images are binary PGM, PPM or PAM files with maxval 255.\n"
+        "\n"
+        "options:\n"
+        "  -b border     radius to take texture from (default 50)\n"
+        "  -t tries      random search thoroughness (default 20)\n"
+        "  -p comp_size  patch size (default 3)\n"
+        "  -u size       transfer unit size (default 2)\n"
+        "  -a max        max color adjustment applied to transferred patch (default 0)\n"
+        "  -e            apply the same amount of adjustment to all channels\n"
+        "  -r refmap     use nonzero points of refmap as reference area\n"
+        "  -j threads    number of search threads (default: one per core)\n"
+        "  -P            refine tiles of the selection in parallel too\n"
+        "  -l levels     synthesize coarse to fine on up to this many levels (default 1)\n"
+        "  -k count      rank this many similar patches found through an index\n"
+        "                instead of random tries (default 0, random tries)\n"
+        "  -s seed       seed of the random search, the same seed gives the same\n"
+        "                result (default 0, a new seed every run)\n"
+        "  -c            fill separate parts of the selection as parallel jobs\n"
+        "  -d ms         time budget: fill first, then refine the worst matches\n"
+        "                until ms milliseconds have passed (default 0, no limit)\n"
+        "  -w            warm start: keep the nearest neighbour field of a heal in\n"
+        "                image.nnf, a later heal of the same image starts from it\n"
+        "  -f            the jobs are consecutive frames of a sequence, every frame\n"
+        "                starts from the field of the previous one moved along\n"
+        "                with the frame content\n"
+        "  -S file       append statistics of every job to file as a JSON line,\n"
+        "                - for stdout\n",
+        argv0);
+}
+
+// append stats of one job as a JSON line
+static void write_stats(FILE* file, const char* image_filename, const synthesis_stats& stats)
+{
+    fprintf(file, "{\"image\": \"");
+    for (const char* c=image_filename; *c; ++c) {
+        if (*c == '"' || *c == '\\')
+            fputc('\\', file);
+        fputc(*c, file);
+    }
+    fprintf(file, "\", \"stats\": ");
+    write_stats_json(file, stats);
+    fprintf(file, "}\n");
+}
+
+// bounding box of the points nonzero in the first channel of mask
+static Rectangle mask_bounds(const Bitmap<uint8_t>& mask)
+{
+    Rectangle bounds(mask.width, mask.height, 0, 0);
+    for (int y=0; y<mask.height; ++y)
+        for (int x=0; x<mask.width; ++x)
+            if (mask.at(x, y)[0]) {
+                bounds.x1 = min(bounds.x1, x);
+                bounds.y1 = min(bounds.y1, y);
+                bounds.x2 = max(bounds.x2, x + 1);
+                bounds.y2 = max(bounds.y2, y + 1);
+            }
+    return bounds;
+}
+
+// rows of a file scanned at a time for bounds
+static const int band_height = 64;
+
+// bounds_of applied to the whole image of reader, which is read in bands
+// so that only the synthesis region is ever held whole
+static bool file_bounds(pnm_reader& reader, Rectangle (*bounds_of)(const Bitmap<uint8_t>&),
+        Rectangle& bounds)
+{
+    bounds = Rectangle(reader.width, reader.height, 0, 0);
+    Bitmap<uint8_t> band;
+    for (int y1=0; y1<reader.height; y1+=band_height) {
+        if (!reader.read(Rectangle(0, y1, reader.width, min(y1 + band_height, reader.height)), band))
+            return false;
+        Rectangle band_bounds = bounds_of(band);
+        if (band_bounds.x1 >= band_bounds.x2)
+            continue;
+        bounds.x1 = min(bounds.x1, band_bounds.x1);
+        bounds.y1 = min(bounds.y1, band_bounds.y1 + y1);
+        bounds.x2 = max(bounds.x2, band_bounds.x2);
+        bounds.y2 = max(bounds.y2, band_bounds.y2 + y1);
+    }
+    return true;
+}
+
+// hash of the raster of reader, which is read in bands
+static bool file_hash(pnm_reader& reader, uint64_t& hash)
+{
+    hash = hash_seed;
+    Bitmap<uint8_t> band;
+    for (int y1=0; y1<reader.height; y1+=band_height) {
+        if (!reader.read(Rectangle(0, y1, reader.width, min(y1 + band_height, reader.height)), band))
+            return false;
+        hash = hash_bytes(band.data, size_t(band.width)*band.height*band.depth, hash);
+    }
+    return true;
+}
+
+// largest frame to frame motion looked for in a sequence, in pixels
+static const int max_frame_motion = 16;
+
+// what a frame of a sequence leaves for the next one
+struct previous_frame
+{
+    bool valid;
+    int width, height;
+    // the healed synthesis region of the frame and where it lies
+    Bitmap<uint8_t> work;
+    Coordinates origin;
+    // in frame coordinates
+    source_field field;
+
+    previous_frame(): valid(false), width(0), height(0) {}
+};
+
+static bool heal(synthesis_context& context, const Parameters& parameters,
+        int border, const char* ref_filename, bool warm_start, previous_frame* sequence,
+        FILE* stats_file,
+        const char* image_filename, const char* mask_filename, const char* output_filename)
+{
+    // the previous frame is carried on only by a frame healed successfully,
+    // the frame after a failed one starts cold
+    bool previous_valid = sequence && sequence->valid;
+    if (sequence)
+        sequence->valid = false;
+
+    pnm_reader image, mask, ref;
+
+    if (!image.open(image_filename)) {
+        fprintf(stderr, "can't read image %s\n", image_filename);
+        return false;
+    }
+
+    if (!mask.open(mask_filename)) {
+        fprintf(stderr, "can't read mask %s\n", mask_filename);
+        return false;
+    }
+
+    if (mask.width != image.width || mask.height != image.height) {
+        fprintf(stderr, "mask %s doesn't match image %s in size\n", mask_filename, image_filename);
+        return false;
+    }
+
+    Rectangle ref_bounds;
+    if (ref_filename) {
+        if (!ref.open(ref_filename)) {
+            fprintf(stderr, "can't read reference map %s\n", ref_filename);
+            return false;
+        }
+        if (ref.width != image.width || ref.height != image.height) {
+            fprintf(stderr, "reference map %s doesn't match image %s in size\n", ref_filename, image_filename);
+            return false;
+        }
+        if (!file_bounds(ref, reference_bounds, ref_bounds)) {
+            fprintf(stderr, "can't read reference map %s\n", ref_filename);
+            return false;
+        }
+    }
+
+    // selection bounds, x2 and y2 are exclusive like in gimp_drawable_mask_bounds
+    Rectangle selection;
+    if (!file_bounds(mask, mask_bounds, selection)) {
+        fprintf(stderr, "can't read mask %s\n", mask_filename);
+        return false;
+    }
+
+    // an empty mask leaves the image as it is, an empty patch copies every row
+    if (selection.x1 >= selection.x2) {
+        fprintf(stderr, "nothing to heal in %s, copied unchanged\n", image_filename);
+        if (!write_pnm_patched(output_filename, image, Bitmap<uint8_t>(), 0, 0)) {
+            fprintf(stderr, "can't write %s\n", output_filename);
+            return false;
+        }
+        return true;
+    }
+
+    // mimic smart-remove.scm: selection grown by border and cropped to image
+    int corpus_width, corpus_height;
+    if (ref_filename) {
+        corpus_width  = ref.width;
+        corpus_height = ref.height;
+    } else {
+        corpus_width  = min(selection.x2 + border, image.width)  - max(selection.x1 - border, 0);
+        corpus_height = min(selection.y2 + border, image.height) - max(selection.y1 - border, 0);
+    }
+    Rectangle corpus = corpus_region(parameters, image.width, image.height,
+            corpus_width, corpus_height, selection);
+    // the corpus keeps a patch radius away from the borders
+    if (!ref_filename && (corpus.x1 >= corpus.x2 || corpus.y1 >= corpus.y2)) {
+        fprintf(stderr, "image %s too small for patch size %d\n",
+                image_filename, parameters.comp_size);
+        return false;
+    }
+
+    // synthesize only the part of the image it can touch,
+    // the rest is streamed from the input to the output.
+    // The part has to fit the Bitmaps of image, mask and ref layer,
+    // of up to 4 channels each
+    Rectangle region = synthesis_region(parameters, image.width, image.height, selection,
+            ref_filename ? ref_bounds : corpus);
+    if (region.width() > max_state_map_side || region.height() > max_state_map_side ||
+        int64_t(region.width())*region.height()*4 > max_bitmap_size)
+    {
+        fprintf(stderr, "region to heal in %s too large\n", image_filename);
+        return false;
+    }
+    // a field sidecar belongs to this selection and corpus of the image
+    Rectangle image_selection = selection, image_corpus = corpus;
+    selection = Rectangle(selection.x1 - region.x1, selection.y1 - region.y1,
+            selection.x2 - region.x1, selection.y2 - region.y1);
+    corpus = Rectangle(corpus.x1 - region.x1, corpus.y1 - region.y1,
+            corpus.x2 - region.x1, corpus.y2 - region.y1);
+
+    Bitmap<uint8_t> work, work_mask, work_ref_layer;
+    if (!image.read(region, work) || !mask.read(region, work_mask) ||
+        (ref_filename && !ref.read(region, work_ref_layer)))
+    {
+        fprintf(stderr, "can't read %s\n", image_filename);
+        return false;
+    }
+    mask.close();
+    ref.close();
+
+    // the field of the previous frame moved along with the content,
+    // or of an earlier heal of the same image, any other is ignored
+    std::string field_filename = std::string(image_filename) + ".nnf";
+    uint64_t image_hash = 0;
+    source_field initial;
+    bool warm = false;
+    if (previous_valid &&
+        sequence->width == image.width && sequence->height == image.height)
+    {
+        Coordinates motion = estimate_motion(sequence->work, sequence->origin,
+                work, work_mask, Coordinates(region.x1, region.y1), max_frame_motion);
+        initial = sequence->field;
+        initial.translate(motion.x, motion.y);
+        warm = true;
+    }
+    if (warm_start) {
+        if (!file_hash(image, image_hash)) {
+            fprintf(stderr, "can't read %s\n", image_filename);
+            return false;
+        }
+        if (!warm)
+            warm = read_field_sidecar(field_filename.c_str(), image_hash,
+                    image.width, image.height, image_selection, image_corpus, initial);
+    }
+    if (warm)
+        initial.translate(-region.x1, -region.y1);
+
+    context.configure(parameters, image.bpp);
+    if (!context.run(work, work_mask, ref_filename ? &work_ref_layer : NULL,
+            selection, corpus, warm ? &initial : NULL))
+    {
+        fprintf(stderr, "no unmasked points to heal %s from\n", image_filename);
+        return false;
+    }
+
+    source_field field;
+    if (warm_start || sequence) {
+        field = context.field();
+        field.translate(region.x1, region.y1);
+    }
+
+    if (warm_start && !write_field_sidecar(field_filename.c_str(), image_hash,
+            image.width, image.height, image_selection, image_corpus, field))
+    {
+        fprintf(stderr, "can't write %s\n", field_filename.c_str());
+        return false;
+    }
+
+    if (stats_file)
+        write_stats(stats_file, image_filename, context.stats());
+
+    if (!write_pnm_patched(output_filename, image, work, region.x1, region.y1)) {
+        fprintf(stderr, "can't write %s\n", output_filename);
+        return false;
+    }
+
+    if (sequence) {
+        sequence->valid  = true;
+        sequence->width  = image.width;
+        sequence->height = image.height;
+        sequence->work.swap(work);
+        sequence->origin = Coordinates(region.x1, region.y1);
+        sequence->field.bounds = field.bounds;
+        sequence->field.sources.swap(field.sources);
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    Parameters parameters;
+    parameters.corpus_id        = -1;
+    parameters.neighbours       = 0;
+    parameters.tries            = 20;
+    parameters.comp_size        = 3;
+    parameters.transfer_size    = 2;
+    parameters.invent_gradients = false;
+    parameters.max_adjustment   = 0;
+    parameters.equal_adjustment = false;
+    parameters.use_ref_layer    = false;
+    parameters.threads          = 0;
+    parameters.parallel_refinement = false;
+    parameters.pyramid_levels   = 1;
+    parameters.ann_candidates   = 0;
+    parameters.seed             = 0;
+    parameters.split_components = false;
+    parameters.time_budget_ms   = 0;
+
+    int border = 50;
+    const char* ref_filename = NULL;
+    const char* stats_filename = NULL;
+    bool warm_start = false;
+    bool frames = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:t:p:u:a:er:j:Pl:k:s:cd:wfS:h")) != -1) {
+        switch (opt) {
+        case 'b': border = atoi(optarg); break;
+        case 't': parameters.tries = atoi(optarg); break;
+        case 'p': parameters.comp_size = atoi(optarg); break;
+        case 'u': parameters.transfer_size = atoi(optarg); break;
+        case 'a': parameters.max_adjustment = atoi(optarg); break;
+        case 'e': parameters.equal_adjustment = true; break;
+        case 'j': parameters.threads = atoi(optarg); break;
+        case 'P': parameters.parallel_refinement = true; break;
+        case 'l': parameters.pyramid_levels = atoi(optarg); break;
+        case 'k': parameters.ann_candidates = atoi(optarg); break;
+        case 's': parameters.seed = atoi(optarg); break;
+        case 'c': parameters.split_components = true; break;
+        case 'd': parameters.time_budget_ms = atoi(optarg); break;
+        case 'w': warm_start = true; break;
+        case 'f': frames = true; break;
+        case 'S': stats_filename = optarg; break;
+        case 'r':
+            ref_filename = optarg;
+            parameters.use_ref_layer = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    int job_args = argc - optind;
+    if (!job_args || job_args%3 || parameters.tries < 1 || parameters.comp_size < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE* stats_file = NULL;
+    if (stats_filename) {
+        stats_file = strcmp(stats_filename, "-") ? fopen(stats_filename, "a") : stdout;
+        if (!stats_file) {
+            fprintf(stderr, "can't open %s\n", stats_filename);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // jobs run one after the other on the same buffers and threads
+    synthesis_context context;
+    previous_frame sequence;
+    int failed = 0;
+    for (int i=optind; i<argc; i+=3)
+        if (!heal(context, parameters, border, ref_filename, warm_start,
+                frames ? &sequence : NULL, stats_file,
+                argv[i], argv[i+1], argv[i+2]))
+            ++failed;
+
+    if (stats_file && stats_file != stdout)
+        fclose(stats_file);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -10,5 +10,21 @@ const size_t important_count         = 6;
 const int in_loop_pass_count         = 20;
 const int refine_pass_count          = 4;
 
+// side of the square tiles refined concurrently in parallel refinement
+const int refine_tile_size           = 32;
+
+// patch index: points per kd-tree leaf and leaves visited per query
+const int ann_leaf_size              = 8;
+const int ann_max_leaves             = 8;
+
+// a point seeded from an initial field tries the sources of the points
+// this far around it in the field too, shifted back, so a slightly
+// misaligned field (moved frame content, changed selection) still seeds
+// well. The window is spatial, earlier frames aren't compared against
+const int seed_spatial_radius        = 1;
+
+// grid spacing of the points compared by motion estimation
+const int motion_sample_step         = 4;
+
 #endif // ESYNTH_CONSTS_H
 
@@ -0,0 +1,112 @@
+#include "unufo_frontier.h"
+
+#include "unufo_consts.h"
+#include "unufo_geometry.h"
+#include "unufo_patch.h"
+
+using namespace std;
+
+namespace unufo {
+
+void edge_frontier::reset(const Bitmap<uint8_t>& data,
+        const StateMap& states,
+        const BitPlane& defined,
+        const vector<Coordinates>& points,
+        int comp_patch_radius, int bpp)
+{
+    comp_patch_radius_ = comp_patch_radius;
+    bpp_ = bpp;
+    complexity_fn_ = select_patch_kernels(comp_patch_radius, bpp).complexity;
+
+    complexity_.resize(data.width, data.height);
+    for (int i=0; i<data.width*data.height; ++i)
+        complexity_.data[i] = -1;
+    dirty_.resize(data.width, data.height);
+    dirty_points_.clear();
+    queue_ = priority_queue<pair<int, Coordinates>>();
+    size_ = 0;
+
+    for (size_t i=0; i<points.size(); ++i)
+        evaluate(data, states, defined, points[i]);
+}
+
+void edge_frontier::touch(const Coordinates& position)
+{
+    // complexity looks at the patch around a point,
+    // being an edge point only at the 3x3 neighbourhood
+    int radius = max(comp_patch_radius_, 1);
+    int x1 = max(position.x - radius, 0);
+    int y1 = max(position.y - radius, 0);
+    int x2 = min(position.x + radius, complexity_.width - 1);
+    int y2 = min(position.y + radius, complexity_.height - 1);
+    for (int y=y1; y<=y2; ++y)
+        for (int x=x1; x<=x2; ++x)
+            if (!*dirty_.at(x, y)) {
+                *dirty_.at(x, y) = 1;
+                dirty_points_.push_back(Coordinates(x, y));
+            }
+}
+
+void edge_frontier::update(const Bitmap<uint8_t>& data,
+        const StateMap& states,
+        const BitPlane& defined)
+{
+    for (size_t i=0; i<dirty_points_.size(); ++i) {
+        *dirty_.at(dirty_points_[i]) = 0;
+        evaluate(data, states, defined, dirty_points_[i]);
+    }
+    dirty_points_.clear();
+}
+
+void edge_frontier::evaluate(const Bitmap<uint8_t>& data,
+        const StateMap& states,
+        const BitPlane& defined,
+        const Coordinates& position)
+{
+    int complexity = -1;
+    if (!defined.get(position) && !states.at(position)->held()) {
+        bool island_flag = true;
+        for (int ox=-1; ox<=1; ++ox)
+            for (int oy=-1; oy<=1; ++oy) {
+                Coordinates point_off = position + Coordinates(ox, oy);
+                if (clip(data, point_off) && states.at(point_off)->confidence)
+                    island_flag = false;
+            }
+        if (!island_flag)
+            complexity = complexity_fn_(data, states, defined,
+                    position, comp_patch_radius_, bpp_);
+    }
+
+    int& current = *complexity_.at(position);
+    if (complexity == current)
+        return;
+
+    if (current < 0)
+        ++size_;
+    if (complexity < 0)
+        --size_;
+    else
+        queue_.push(make_pair(complexity, position));
+    current = complexity;
+}
+
+void edge_frontier::take(vector<Coordinates>& edge_points)
+{
+    // leave only the most important edge_points
+    size_t count = size_ > important_count ? size_/2 : size_;
+
+    edge_points.clear();
+    while (edge_points.size() < count) {
+        pair<int, Coordinates> top = queue_.top();
+        queue_.pop();
+        int& current = *complexity_.at(top.second);
+        if (current != top.first)
+            continue;
+        current = -1;
+        --size_;
+        edge_points.push_back(top.second);
+    }
+    reverse(edge_points.begin(), edge_points.end());
+}
+
+}
@@ -0,0 +1,66 @@
+#ifndef UNUFO_FRONTIER_H
+#define UNUFO_FRONTIER_H
+
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "unufo_patch.h"
+#include "unufo_types.h"
+
+namespace unufo {
+
+/// unfilled points next to filled ones, ordered by complexity.
+/// Only points near changed ones are re-evaluated, so keeping it
+/// up to date costs in proportion to the points filled.
+class edge_frontier
+{
+public:
+    edge_frontier(): size_(0) {}
+
+    /// forget everything and evaluate points, which must be all unfilled points
+    /// except held ones, held points never enter the frontier
+    void reset(const Bitmap<uint8_t>& data,
+            const StateMap& states,
+            const BitPlane& defined,
+            const std::vector<Coordinates>& points,
+            int comp_patch_radius, int bpp);
+
+    /// note that position was filled or changed,
+    /// its neighbourhood is re-evaluated on the next update()
+    void touch(const Coordinates& position);
+
+    /// re-evaluate points around the ones touched since the last update
+    void update(const Bitmap<uint8_t>& data,
+            const StateMap& states,
+            const BitPlane& defined);
+
+    size_t size() const { return size_; }
+
+    /// remove the most complex half of the frontier (all of it when it is
+    /// small) and return it in edge_points, least complex first
+    void take(std::vector<Coordinates>& edge_points);
+
+private:
+    void evaluate(const Bitmap<uint8_t>& data,
+            const StateMap& states,
+            const BitPlane& defined,
+            const Coordinates& position);
+
+    // complexity of points in the frontier, -1 for the rest
+    Matrix<int> complexity_;
+    // entries whose complexity doesn't match complexity_ are stale
+    std::priority_queue<std::pair<int, Coordinates>> queue_;
+    size_t size_;
+
+    Matrix<uint8_t> dirty_;
+    std::vector<Coordinates> dirty_points_;
+
+    int comp_patch_radius_;
+    int bpp_;
+    complexity_fn complexity_fn_;
+};
+
+}
+
+#endif // UNUFO_FRONTIER_H
@@ -1,13 +1,14 @@
 #include "unufo_geometry.h"
 
 #include "unufo_consts.h"
+#include "unufo_kernels.h"
 
 namespace unufo {
 
 // TODO: consider mirroring and rotation by passing orientation
 // collect pixels defined both near pos and near candidate
 int collect_defined_in_both_areas(const Bitmap<uint8_t>& data,
-        const Matrix<int>& transfer_belief,
+        const BitPlane& defined,
         const Coordinates& position, const Coordinates& candidate,
         int area_size,
         uint8_t* def_n_p, uint8_t* def_n_c,
@@ -16,87 +17,31 @@ int collect_defined_in_both_areas(const Bitmap<uint8_t>& data,
     int defined_count = 0;
     defined_only_near_pos = 0;
 
-    // figure out if we need to check boundaries in-loop 
-    bool far_from_boundary = (position.x -  area_size >= 0 &&
-                              position.y -  area_size >= 0 &&
-                              position.x +  area_size < data.width &&
-                              position.y +  area_size < data.height &&
-                              candidate.x - area_size >= 0 &&
-                              candidate.y - area_size >= 0 &&
-                              candidate.x + area_size < data.width &&
-                              candidate.y + area_size < data.height);
-
-    uint8_t* d_n_p =  data.at(position  + Coordinates(-area_size, -area_size));
-    uint8_t* d_n_c =  data.at(candidate + Coordinates(-area_size, -area_size));
-    int* ds_n_p = transfer_belief.at(position  + Coordinates(-area_size, -area_size));
-    int* ds_n_c = transfer_belief.at(candidate + Coordinates(-area_size, -area_size));
-
-    int d_shift  = (data.width - (2*area_size + 1));
-    if (far_from_boundary) {
-        // branch without in-loop boundary checking
-        for (int oy=-area_size; oy<=area_size; ++oy) {
-            for (int ox=-area_size; ox<=area_size; ++ox) {
-                if (*ds_n_c>=0 && *ds_n_p>=0)
-                {
-                    ++defined_count;
-
-                    // 4 byte copy
-                    *((int32_t*)def_n_p) = *((int32_t*)d_n_p);
-                    *((int32_t*)def_n_c) = *((int32_t*)d_n_c);
-
-                    def_n_p += 4;
-                    def_n_c += 4;
-                } else if (-1 == *ds_n_c) {
-                    // also collect number of points defined only near destination pos
-                    ++defined_only_near_pos;
-                }
-                d_n_p  += 4;
-                d_n_c  += 4;
-                ++ds_n_p;
-                ++ds_n_c;
-            }
-            d_n_p  += 4*d_shift;
-            d_n_c  += 4*d_shift;
-            ds_n_p += d_shift;
-            ds_n_c += d_shift;
-        }
-    } else {
-        // branch with in-loop boundary checking
-        for (int oy=-area_size; oy<=area_size; ++oy) {
-            for (int ox=-area_size; ox<=area_size; ++ox) {
-                if (position.x + ox >= 0 &&
-                    position.y + oy >= 0 &&
-                    position.x + ox < data.width &&
-                    position.y + oy < data.height &&
-                    candidate.x + ox >= 0 &&
-                    candidate.y + oy >= 0 &&
-                    candidate.x + ox < data.width &&
-                    candidate.y + oy < data.height)
-                {
-                    if (*ds_n_c>=0 && *ds_n_p>=0)
-                    {
-                        ++defined_count;
-
-                        // 4 byte copy
-                        *((int32_t*)def_n_p) = *((int32_t*)d_n_p);
-                        *((int32_t*)def_n_c) = *((int32_t*)d_n_c);
-
-                        def_n_p += 4;
-                        def_n_c += 4;
-                    } else if (-1 == *ds_n_c) {
-                        // also collect number of points defined only near destination pos
-                        ++defined_only_near_pos;
-                    }
-                }
-                d_n_p  += 4;
-                d_n_c  += 4;
-                ++ds_n_p;
-                ++ds_n_c;
+    // only offsets inside the image around both points count
+    Coordinates from, to;
+    patch_overlap(data, position, candidate, area_size, from, to);
+    int width = to.x - from.x + 1;
+
+    int bpp = data.depth;
+    for (int oy=from.y; oy<=to.y; ++oy) {
+        const uint64_t* row_p = defined.row(position.y  + oy);
+        const uint64_t* row_c = defined.row(candidate.y + oy);
+        // the row in bit runs, the mask of both areas is an AND away
+        for (int ox=from.x; ox<=to.x; ox+=bit_run_size) {
+            uint64_t segment = (uint64_t(1) << std::min(width - (ox - from.x), bit_run_size)) - 1;
+            uint64_t near_c = bit_run(row_c, candidate.x + ox);
+            uint64_t both = bit_run(row_p, position.x + ox) & near_c & segment;
+            defined_count += __builtin_popcountll(both);
+            // also collect number of points defined only near destination pos
+            defined_only_near_pos += __builtin_popcountll(~near_c & segment);
+
+            for (; both; both &= both - 1) {
+                int x = ox + __builtin_ctzll(both);
+                memcpy(def_n_p, data.at(position.x  + x, position.y  + oy), bpp);
+                memcpy(def_n_c, data.at(candidate.x + x, candidate.y + oy), bpp);
+                def_n_p += bpp;
+                def_n_c += bpp;
             }
-            d_n_p  += 4*d_shift;
-            d_n_c  += 4*d_shift;
-            ds_n_p += d_shift;
-            ds_n_c += d_shift;
         }
     }
     return defined_count;
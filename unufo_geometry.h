@@ -15,8 +15,28 @@ inline bool clip(const Bitmap<uint8_t>& image, const Coordinates& point)
     return true;
 }
 
+/// whether a point of a reference layer marks a source point,
+/// its first channel or the alpha of an RGBA layer is nonzero
+inline bool is_reference_point(const Bitmap<uint8_t>& ref_layer, int x, int y)
+{
+    const uint8_t* pixel = ref_layer.at(x, y);
+    return pixel[0] || (ref_layer.depth == 4 && pixel[3]);
+}
+
+/// offsets [from, to] around both position and candidate which stay
+/// inside the image, at most area_size in each direction
+inline void patch_overlap(const Bitmap<uint8_t>& image,
+        const Coordinates& position, const Coordinates& candidate,
+        int area_size, Coordinates& from, Coordinates& to)
+{
+    from.x = -std::min(area_size, std::min(position.x, candidate.x));
+    from.y = -std::min(area_size, std::min(position.y, candidate.y));
+    to.x = std::min(area_size, image.width  - 1 - std::max(position.x, candidate.x));
+    to.y = std::min(area_size, image.height - 1 - std::max(position.y, candidate.y));
+}
+
 int collect_defined_in_both_areas(const Bitmap<uint8_t>& data,
-        const Matrix<int>& transfer_belief,
+        const BitPlane& defined,
         const Coordinates& position, const Coordinates& candidate,
         int area_size,
         uint8_t* def_n_p, uint8_t* def_n_c,
@@ -4,6 +4,9 @@
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
 
+#include "unufo_synth.h"
+#include "unufo_types.h"
+
 /* Inclusion : Laurent Despeyroux
    This is for other GNU distributions with internationalized messages.
    When compiling libc, the "_" macro is predefined.  */
@@ -15,21 +18,119 @@
 const int WORK_LAYER_PARAM_ID = 2;
 const int REF_LAYER_PARAM_ID = 11;
 
-//Get a drawable and possibly its selection mask from the GIMP
+// Pixels travel between the GIMP and bitmaps one tile at a time, so no
+// copy of a whole region is ever held next to the bitmap.
+
+// call f with every cell of the GIMP tile grid clipped to rect
+template<class F>
+void for_each_tile(const Rectangle& rect, F f)
+{
+    int tile_width = gimp_tile_width(), tile_height = gimp_tile_height();
+    for (int y = rect.y1 - rect.y1%tile_height; y < rect.y2; y += tile_height)
+        for (int x = rect.x1 - rect.x1%tile_width; x < rect.x2; x += tile_width)
+            f(Rectangle(std::max(x, rect.x1), std::max(y, rect.y1),
+                    std::min(x + tile_width, rect.x2), std::min(y + tile_height, rect.y2)));
+}
+
+// copy rect of drawable into bitmap with its top left corner at (x1, y1)
+void copy_from_drawable(Bitmap<uint8_t>& bitmap, int x1, int y1,
+        GimpDrawable *drawable, const Rectangle& rect, int dest_layer)
+{
+    int bpp = drawable->bpp;
+    GimpPixelRgn region;
+    gimp_pixel_rgn_init(&region, drawable, rect.x1, rect.y1, rect.width(), rect.height(),
+            FALSE, FALSE);
+
+    guchar *tile = new guchar[gimp_tile_width()*gimp_tile_height()*bpp];
+    for_each_tile(rect, [&](const Rectangle& part) {
+        gimp_pixel_rgn_get_rect(&region, tile, part.x1, part.y1, part.width(), part.height());
+        const guchar *pixel = tile;
+        for (int y=part.y1; y<part.y2; ++y)
+            for (int x=part.x1; x<part.x2; ++x, pixel += bpp)
+                memcpy(bitmap.at(x - rect.x1 + x1, y - rect.y1 + y1) + dest_layer, pixel, bpp);
+    });
+    delete[] tile;
+}
+
+// write bitmap to drawable with its top left corner at (x1, y1),
+// tiles without a point nonzero in changed are skipped if it isn't NULL
+void bitmap_to_drawable(const Bitmap<uint8_t>& bitmap, GimpDrawable *drawable,
+        int x1, int y1, int src_layer, const Bitmap<uint8_t>* changed = NULL)
+{
+    int bpp = drawable->bpp;
+    GimpPixelRgn region;
+    gimp_pixel_rgn_init(&region, drawable, x1, y1, bitmap.width, bitmap.height, TRUE, TRUE);
+
+    guchar *tile = new guchar[gimp_tile_width()*gimp_tile_height()*bpp];
+    for_each_tile(Rectangle(x1, y1, x1 + bitmap.width, y1 + bitmap.height),
+            [&](const Rectangle& part) {
+        bool tile_changed = !changed;
+        for (int y=part.y1; !tile_changed && y<part.y2; ++y)
+            for (int x=part.x1; !tile_changed && x<part.x2; ++x)
+                tile_changed = changed->at(x - x1, y - y1)[0];
+        if (!tile_changed)
+            return;
+
+        guchar *pixel = tile;
+        for (int y=part.y1; y<part.y2; ++y)
+            for (int x=part.x1; x<part.x2; ++x, pixel += bpp)
+                memcpy(pixel, bitmap.at(x - x1, y - y1) + src_layer, bpp);
+        gimp_pixel_rgn_set_rect(&region, tile, part.x1, part.y1, part.width(), part.height());
+    });
+    delete[] tile;
+}
+
+void bitmap_from_drawable(Bitmap<uint8_t>& bitmap, GimpDrawable *drawable,
+        int x1, int y1, int dest_layer)
+{
+    copy_from_drawable(bitmap, 0, 0, drawable,
+            Rectangle(x1, y1, x1 + bitmap.width, y1 + bitmap.height), dest_layer);
+}
+
+/* Bounding box of the selection, the whole drawable if nothing is selected */
+Rectangle get_selection_bounds(GimpDrawable *drawable)
+{
+    Rectangle bounds;
+    gimp_drawable_mask_bounds(drawable->drawable_id,
+            &bounds.x1, &bounds.y1, &bounds.x2, &bounds.y2);
+    return bounds;
+}
+
+/* Bounding box of the reference points of drawable, read a tile at a time */
+Rectangle get_reference_bounds(GimpDrawable *drawable)
+{
+    Rectangle bounds(drawable->width, drawable->height, 0, 0);
+    Bitmap<uint8_t> tile;
+    for_each_tile(Rectangle(0, 0, drawable->width, drawable->height),
+            [&](const Rectangle& part) {
+        tile.resize(part.width(), part.height(), drawable->bpp);
+        bitmap_from_drawable(tile, drawable, part.x1, part.y1, 0);
+        Rectangle tile_bounds = unufo::reference_bounds(tile);
+        if (tile_bounds.x1 >= tile_bounds.x2)
+            return;
+        bounds.x1 = std::min(bounds.x1, tile_bounds.x1 + part.x1);
+        bounds.y1 = std::min(bounds.y1, tile_bounds.y1 + part.y1);
+        bounds.x2 = std::max(bounds.x2, tile_bounds.x2 + part.x1);
+        bounds.y2 = std::max(bounds.y2, tile_bounds.y2 + part.y1);
+    });
+    return bounds;
+}
+
+//Get a drawable and possibly its selection mask from the GIMP,
+//only the part of them covered by region
 void fetch_image_and_mask(GimpDrawable *drawable, Bitmap<uint8_t> &image, int bytes, 
-        Bitmap<uint8_t> &mask, uint8_t default_mask_value,
-        int& sel_x1, int& sel_y1, int& sel_x2, int& sel_y2)
+        Bitmap<uint8_t> &mask, uint8_t default_mask_value, const Rectangle& region)
 {
-    int x,y, xoff, yoff;
-    Bitmap<uint8_t> temp_mask;
+    int xoff, yoff;
     int sel_id;
     int has_selection;
+    int sel_x1, sel_y1, sel_x2, sel_y2;
     GimpDrawable *mask_drawable;
 
-    image.resize(drawable->width, drawable->height, bytes);
-    mask.resize(drawable->width, drawable->height, 1);
+    image.resize(region.width(), region.height(), bytes);
+    mask.resize(region.width(), region.height(), 1);
 
-    image.from_drawable(drawable,0,0,0);
+    bitmap_from_drawable(image, drawable, region.x1, region.y1, 0);
 
     has_selection = gimp_drawable_mask_bounds(drawable->drawable_id,
             &sel_x1, &sel_y1, &sel_x2, &sel_y2);
@@ -40,27 +141,30 @@ void fetch_image_and_mask(GimpDrawable *drawable, Bitmap<uint8_t> &image, int by
         return;
     }
 
-    temp_mask.resize(sel_x2-sel_x1, sel_y2-sel_y1, 1);
+    sel_x1 = std::max(sel_x1, region.x1);
+    sel_y1 = std::max(sel_y1, region.y1);
+    sel_x2 = std::min(sel_x2, region.x2);
+    sel_y2 = std::min(sel_y2, region.y2);
+
+    memset(mask.data, 0, mask.width*mask.height*sizeof(uint8_t));
+    if (sel_x1 >= sel_x2 || sel_y1 >= sel_y2)
+        return;
 
     sel_id = gimp_image_get_selection(gimp_drawable_get_image(drawable->drawable_id));
     mask_drawable = gimp_drawable_get(sel_id);
 
-
-    temp_mask.from_drawable(mask_drawable, sel_x1+xoff, sel_y1+yoff, 0);
+    // the selection channel is in image coordinates
+    copy_from_drawable(mask, sel_x1 - region.x1, sel_y1 - region.y1, mask_drawable,
+            Rectangle(sel_x1 + xoff, sel_y1 + yoff, sel_x2 + xoff, sel_y2 + yoff), 0);
 
     gimp_drawable_detach(mask_drawable);
-
-    memset(mask.data, 0, mask.width*mask.height*sizeof(uint8_t));
-    for(y=0;y<temp_mask.height;y++)
-        for(x=0;x<temp_mask.width;x++)
-            mask.at(x+sel_x1,y+sel_y1)[0] = temp_mask.at(x,y)[0];
 }
 
 void fetch_image_and_mask(GimpDrawable *drawable, Bitmap<uint8_t> &image, int bytes, 
         Bitmap<uint8_t> &mask, uint8_t default_mask_value)
 {
-    int x1, y1, x2, y2;
-    fetch_image_and_mask(drawable, image, bytes, mask, default_mask_value, x1, y1, x2, y2);
+    fetch_image_and_mask(drawable, image, bytes, mask, default_mask_value,
+            Rectangle(0, 0, drawable->width, drawable->height));
 }
 
 /* Convert argument list into parameters */
@@ -77,6 +181,13 @@ static bool get_parameters_from_list(Parameters *param, int n_args, const GimpPa
     param->max_adjustment   = args[8].data.d_int32;
     param->equal_adjustment = args[9].data.d_int32;
     param->use_ref_layer    = args[10].data.d_int32;
+    param->threads          = 0;
+    param->parallel_refinement = false;
+    param->pyramid_levels   = 1;
+    param->ann_candidates   = 0;
+    param->seed             = 0;
+    param->split_components = false;
+    param->time_budget_ms   = 0;
 
     return true;
 }
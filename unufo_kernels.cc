@@ -0,0 +1,568 @@
+#include "unufo_kernels.h"
+
+#include "unufo_pixel.h"
+
+#include <algorithm>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+namespace unufo {
+
+// bits of up to bit_run_size pixels of a patch row from x on which are
+// defined in both patches, counting them into compared and the ones
+// undefined near the candidate into undefined
+static inline uint64_t defined_in_both(const defined_bits& pos_defined,
+        const defined_bits& cand_defined, int x, int width,
+        int& compared, int& undefined)
+{
+    uint64_t segment = (uint64_t(1) << std::min(width - x, bit_run_size)) - 1;
+    uint64_t cand = bit_run(cand_defined.row, cand_defined.bit + x);
+    uint64_t both = bit_run(pos_defined.row, pos_defined.bit + x) & cand & segment;
+    compared  += __builtin_popcountll(both);
+    undefined += __builtin_popcountll(~cand & segment);
+    return both;
+}
+
+// portable kernels, used when SSE2 isn't available or use_kernels() asks for them
+
+template <int bpp>
+static void masked_ssd_generic(const uint8_t* pos_pixels, const uint8_t* cand_pixels,
+        defined_bits pos_defined, defined_bits cand_defined,
+        int width, int height, int stride, int bound, patch_sums& sums)
+{
+    int ssd = 0, compared = 0, undefined = 0;
+    bool pruned = false;
+    for (int y=0; y<height && !pruned; ++y) {
+        for (int x0=0; x0<width; x0+=bit_run_size) {
+            uint64_t both = defined_in_both(pos_defined, cand_defined, x0, width,
+                    compared, undefined);
+            // visit the pixels defined in both patches only
+            for (; both; both &= both - 1) {
+                int x = x0 + __builtin_ctzll(both);
+                for (int j=0; j<bpp; ++j)
+                    ssd += pixel_diff(cand_pixels[bpp*x + j], pos_pixels[bpp*x + j]);
+            }
+        }
+        pruned = y+1 < height && undefined*max_diff + ssd >= bound;
+        pos_pixels  += bpp*stride;
+        cand_pixels += bpp*stride;
+        pos_defined.row  += pos_defined.stride;
+        cand_defined.row += cand_defined.stride;
+    }
+    sums.ssd       = ssd;
+    sums.compared  = compared;
+    sums.undefined = undefined;
+    sums.pruned    = pruned;
+}
+
+// whether undefined*max_diff plus the smallest adjusted difference
+// left by the moments seen so far reaches bound
+static inline bool moments_reach(const int sum[4], const int sum_sq[4],
+        int compared, int undefined, int bound)
+{
+    int64_t lower = int64_t(undefined)*max_diff;
+    if (compared)
+        for (int j=0; j<4; ++j)
+            // the adjusted difference is an integer not below sum_sq - sum^2/compared
+            lower += sum_sq[j] - int64_t(sum[j])*sum[j]/compared;
+    return lower >= bound;
+}
+
+static inline void store_moments(const int sum[4], const int sum_sq[4],
+        const int cand_min[4], const int cand_max[4],
+        int compared, int undefined, bool pruned, patch_moments& moments)
+{
+    for (int j=0; j<4; ++j) {
+        moments.sum[j]      = sum[j];
+        moments.sum_sq[j]   = sum_sq[j];
+        moments.cand_min[j] = cand_min[j];
+        moments.cand_max[j] = cand_max[j];
+    }
+    moments.compared  = compared;
+    moments.undefined = undefined;
+    moments.pruned    = pruned;
+}
+
+template <int bpp>
+static void masked_moments_generic(const uint8_t* pos_pixels, const uint8_t* cand_pixels,
+        defined_bits pos_defined, defined_bits cand_defined,
+        int width, int height, int stride, int bound, patch_moments& moments)
+{
+    int sum[4] = {0, 0, 0, 0}, sum_sq[4] = {0, 0, 0, 0};
+    int cand_min[4], cand_max[4] = {0, 0, 0, 0};
+    // channels past bpp read as 0 like in the vector kernels
+    for (int j=0; j<4; ++j)
+        cand_min[j] = j < bpp ? 255 : 0;
+    int compared = 0, undefined = 0;
+    bool pruned = false;
+    for (int y=0; y<height && !pruned; ++y) {
+        for (int x0=0; x0<width; x0+=bit_run_size) {
+            uint64_t both = defined_in_both(pos_defined, cand_defined, x0, width,
+                    compared, undefined);
+            for (; both; both &= both - 1) {
+                int x = x0 + __builtin_ctzll(both);
+                for (int j=0; j<bpp; ++j) {
+                    int c = cand_pixels[bpp*x + j];
+                    int d = pos_pixels[bpp*x + j] - c;
+                    sum[j]    += d;
+                    sum_sq[j] += d*d;
+                    cand_min[j] = std::min(cand_min[j], c);
+                    cand_max[j] = std::max(cand_max[j], c);
+                }
+            }
+        }
+        pruned = y+1 < height && moments_reach(sum, sum_sq, compared, undefined, bound);
+        pos_pixels  += bpp*stride;
+        cand_pixels += bpp*stride;
+        pos_defined.row  += pos_defined.stride;
+        cand_defined.row += cand_defined.stride;
+    }
+    store_moments(sum, sum_sq, cand_min, cand_max, compared, undefined, pruned, moments);
+}
+
+#ifdef __SSE2__
+
+// The vector kernels work on one 32 bit lane per pixel, loaders widen
+// 4 (SSE2) or 8 (AVX2) pixels of bpp channels to that layout,
+// channels past bpp are 0. They read at most 32 bytes.
+
+template <int bpp>
+static inline __m128i load_pixels_sse2(const uint8_t* pixels);
+
+template <>
+inline __m128i load_pixels_sse2<1>(const uint8_t* pixels)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int32_t gray;
+    memcpy(&gray, pixels, sizeof(gray));
+    __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(gray), zero);
+    return _mm_unpacklo_epi16(v, zero);
+}
+
+template <>
+inline __m128i load_pixels_sse2<2>(const uint8_t* pixels)
+{
+    return _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)pixels), _mm_setzero_si128());
+}
+
+template <>
+inline __m128i load_pixels_sse2<3>(const uint8_t* pixels)
+{
+    // lane k takes bytes 3k to 3k+3, the fourth one is masked off
+    __m128i v = _mm_loadu_si128((const __m128i*)pixels);
+    __m128i lo = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+    __m128i hi = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+    return _mm_and_si128(_mm_unpacklo_epi64(lo, hi), _mm_set1_epi32(0xffffff));
+}
+
+template <>
+inline __m128i load_pixels_sse2<4>(const uint8_t* pixels)
+{
+    return _mm_loadu_si128((const __m128i*)pixels);
+}
+
+template <int bpp>
+static inline __m256i load_pixels_avx2(const uint8_t* pixels);
+
+template <>
+__attribute__((target("avx2")))
+inline __m256i load_pixels_avx2<1>(const uint8_t* pixels)
+{
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)pixels));
+}
+
+template <>
+__attribute__((target("avx2")))
+inline __m256i load_pixels_avx2<2>(const uint8_t* pixels)
+{
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)pixels));
+}
+
+template <>
+__attribute__((target("avx2")))
+inline __m256i load_pixels_avx2<3>(const uint8_t* pixels)
+{
+    // 4 pixels into each half, then spread them to 4 byte lanes
+    __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)pixels)),
+            _mm_loadu_si128((const __m128i*)(pixels + 12)), 1);
+    const __m256i spread = _mm256_setr_epi8(
+            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    return _mm256_shuffle_epi8(v, spread);
+}
+
+template <>
+__attribute__((target("avx2")))
+inline __m256i load_pixels_avx2<4>(const uint8_t* pixels)
+{
+    return _mm256_loadu_si256((const __m256i*)pixels);
+}
+
+// squared differences of 4 RGBA pixels, summed pairwise into 4 int32 lanes
+static inline __m128i ssd_4_pixels_sse2(__m128i p, __m128i c)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i d_lo = _mm_sub_epi16(_mm_unpacklo_epi8(p, zero), _mm_unpacklo_epi8(c, zero));
+    __m128i d_hi = _mm_sub_epi16(_mm_unpackhi_epi8(p, zero), _mm_unpackhi_epi8(c, zero));
+    return _mm_add_epi32(_mm_madd_epi16(d_lo, d_lo), _mm_madd_epi16(d_hi, d_hi));
+}
+
+static inline int horizontal_sum_sse2(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+// lane k is all ones if bit k of bits is set, for the low 4 bits
+static inline __m128i expand_bits_sse2(uint64_t bits)
+{
+    const __m128i lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+    return _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(int(bits)), lane_bits), lane_bits);
+}
+
+// as expand_bits_sse2 for the low 8 bits
+__attribute__((target("avx2")))
+static inline __m256i expand_bits_avx2(uint64_t bits)
+{
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(int(bits)), lane_bits), lane_bits);
+}
+
+// the vector kernels take a nonzero size for pixel_kernels::square_*,
+// width and height are runtime values otherwise
+template <int size, int bpp>
+static void masked_ssd_sse2(const uint8_t* pos_pixels, const uint8_t* cand_pixels,
+        defined_bits pos_defined, defined_bits cand_defined,
+        int width, int height, int stride, int bound, patch_sums& sums)
+{
+    if (size) {
+        width  = size;
+        height = size;
+    }
+
+    __m128i acc = _mm_setzero_si128();
+    int ssd = 0, compared = 0, undefined = 0;
+    bool pruned = false;
+    for (int y=0; y<height && !pruned; ++y) {
+        for (int x0=0; x0<width; x0+=bit_run_size) {
+            uint64_t both_bits = defined_in_both(pos_defined, cand_defined, x0, width,
+                    compared, undefined);
+            int x_end = std::min(width, x0 + bit_run_size);
+            for (int x=x0; x<x_end; x+=4, both_bits >>= 4) {
+                // a pixel is one 32 bit lane, so bit masks apply to pixels as they are
+                __m128i both = expand_bits_sse2(both_bits);
+
+                __m128i p = _mm_and_si128(load_pixels_sse2<bpp>(pos_pixels  + bpp*x), both);
+                __m128i c = _mm_and_si128(load_pixels_sse2<bpp>(cand_pixels + bpp*x), both);
+                acc = _mm_add_epi32(acc, ssd_4_pixels_sse2(p, c));
+            }
+        }
+        ssd = horizontal_sum_sse2(acc);
+        pruned = y+1 < height && undefined*max_diff + ssd >= bound;
+        pos_pixels  += bpp*stride;
+        cand_pixels += bpp*stride;
+        pos_defined.row  += pos_defined.stride;
+        cand_defined.row += cand_defined.stride;
+    }
+
+    sums.ssd       = ssd;
+    sums.compared  = compared;
+    sums.undefined = undefined;
+    sums.pruned    = pruned;
+}
+
+template <int size, int bpp>
+__attribute__((target("avx2")))
+static void masked_ssd_avx2(const uint8_t* pos_pixels, const uint8_t* cand_pixels,
+        defined_bits pos_defined, defined_bits cand_defined,
+        int width, int height, int stride, int bound, patch_sums& sums)
+{
+    if (size) {
+        width  = size;
+        height = size;
+    }
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    int ssd = 0, compared = 0, undefined = 0;
+    bool pruned = false;
+    for (int y=0; y<height && !pruned; ++y) {
+        for (int x0=0; x0<width; x0+=bit_run_size) {
+            uint64_t both_bits = defined_in_both(pos_defined, cand_defined, x0, width,
+                    compared, undefined);
+            int x_end = std::min(width, x0 + bit_run_size);
+            for (int x=x0; x<x_end; x+=8, both_bits >>= 8) {
+                __m256i both = expand_bits_avx2(both_bits);
+
+                __m256i p = _mm256_and_si256(load_pixels_avx2<bpp>(pos_pixels  + bpp*x), both);
+                __m256i c = _mm256_and_si256(load_pixels_avx2<bpp>(cand_pixels + bpp*x), both);
+                __m256i d_lo = _mm256_sub_epi16(_mm256_unpacklo_epi8(p, zero), _mm256_unpacklo_epi8(c, zero));
+                __m256i d_hi = _mm256_sub_epi16(_mm256_unpackhi_epi8(p, zero), _mm256_unpackhi_epi8(c, zero));
+                acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d_lo, d_lo));
+                acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d_hi, d_hi));
+            }
+        }
+        ssd = horizontal_sum_sse2(_mm_add_epi32(_mm256_castsi256_si128(acc),
+                                                _mm256_extracti128_si256(acc, 1)));
+        pruned = y+1 < height && undefined*max_diff + ssd >= bound;
+        pos_pixels  += bpp*stride;
+        cand_pixels += bpp*stride;
+        pos_defined.row  += pos_defined.stride;
+        cand_defined.row += cand_defined.stride;
+    }
+
+    sums.ssd       = ssd;
+    sums.compared  = compared;
+    sums.undefined = undefined;
+    sums.pruned    = pruned;
+}
+
+// per-channel sums of differences and of their squares for the 2 RGBA pixels
+// in d (8 int16), each int32 lane of the accumulators is one channel
+static inline void accumulate_moments_sse2(__m128i d, __m128i& sum, __m128i& sum_sq)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    // (d, 0) int16 pairs, madd turns them into d*d or d as int32
+    __m128i a = _mm_unpacklo_epi16(d, zero);
+    __m128i b = _mm_unpackhi_epi16(d, zero);
+    sum_sq = _mm_add_epi32(sum_sq, _mm_add_epi32(_mm_madd_epi16(a, a), _mm_madd_epi16(b, b)));
+    sum    = _mm_add_epi32(sum,    _mm_add_epi32(_mm_madd_epi16(a, one), _mm_madd_epi16(b, one)));
+}
+
+// always inlined, the AVX2 kernels would call it with dirty upper halves
+// of the vector registers otherwise, slowing down its legacy SSE code
+__attribute__((always_inline))
+static inline void store_range_sse2(__m128i cand_min_v, __m128i cand_max_v,
+        int cand_min[4], int cand_max[4])
+{
+    // fold the four pixels of the lanes into one
+    cand_min_v = _mm_min_epu8(cand_min_v, _mm_shuffle_epi32(cand_min_v, _MM_SHUFFLE(1, 0, 3, 2)));
+    cand_min_v = _mm_min_epu8(cand_min_v, _mm_shuffle_epi32(cand_min_v, _MM_SHUFFLE(2, 3, 0, 1)));
+    cand_max_v = _mm_max_epu8(cand_max_v, _mm_shuffle_epi32(cand_max_v, _MM_SHUFFLE(1, 0, 3, 2)));
+    cand_max_v = _mm_max_epu8(cand_max_v, _mm_shuffle_epi32(cand_max_v, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t lo = _mm_cvtsi128_si32(cand_min_v), hi = _mm_cvtsi128_si32(cand_max_v);
+    for (int j=0; j<4; ++j) {
+        cand_min[j] = (lo >> 8*j) & 0xff;
+        cand_max[j] = (hi >> 8*j) & 0xff;
+    }
+}
+
+template <int size, int bpp>
+static void masked_moments_sse2(const uint8_t* pos_pixels, const uint8_t* cand_pixels,
+        defined_bits pos_defined, defined_bits cand_defined,
+        int width, int height, int stride, int bound, patch_moments& moments)
+{
+    if (size) {
+        width  = size;
+        height = size;
+    }
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i minus_one = _mm_set1_epi32(-1);
+
+    __m128i sum_v = zero, sum_sq_v = zero;
+    __m128i cand_min_v = minus_one, cand_max_v = zero;
+    int sum[4], sum_sq[4];
+    int compared = 0, undefined = 0;
+    bool pruned = false;
+    for (int y=0; y<height && !pruned; ++y) {
+        for (int x0=0; x0<width; x0+=bit_run_size) {
+            uint64_t both_bits = defined_in_both(pos_defined, cand_defined, x0, width,
+                    compared, undefined);
+            int x_end = std::min(width, x0 + bit_run_size);
+            for (int x=x0; x<x_end; x+=4, both_bits >>= 4) {
+                __m128i both = expand_bits_sse2(both_bits);
+
+                __m128i p = _mm_and_si128(load_pixels_sse2<bpp>(pos_pixels  + bpp*x), both);
+                __m128i c = _mm_and_si128(load_pixels_sse2<bpp>(cand_pixels + bpp*x), both);
+                accumulate_moments_sse2(_mm_sub_epi16(_mm_unpacklo_epi8(p, zero), _mm_unpacklo_epi8(c, zero)),
+                        sum_v, sum_sq_v);
+                accumulate_moments_sse2(_mm_sub_epi16(_mm_unpackhi_epi8(p, zero), _mm_unpackhi_epi8(c, zero)),
+                        sum_v, sum_sq_v);
+                // pixels not compared must not narrow the range
+                cand_min_v = _mm_min_epu8(cand_min_v, _mm_or_si128(c, _mm_andnot_si128(both, minus_one)));
+                cand_max_v = _mm_max_epu8(cand_max_v, c);
+            }
+        }
+        if (y+1 < height) {
+            _mm_storeu_si128((__m128i*)sum, sum_v);
+            _mm_storeu_si128((__m128i*)sum_sq, sum_sq_v);
+            pruned = moments_reach(sum, sum_sq, compared, undefined, bound);
+        }
+        pos_pixels  += bpp*stride;
+        cand_pixels += bpp*stride;
+        pos_defined.row  += pos_defined.stride;
+        cand_defined.row += cand_defined.stride;
+    }
+
+    int cand_min[4], cand_max[4];
+    _mm_storeu_si128((__m128i*)sum, sum_v);
+    _mm_storeu_si128((__m128i*)sum_sq, sum_sq_v);
+    store_range_sse2(cand_min_v, cand_max_v, cand_min, cand_max);
+    store_moments(sum, sum_sq, cand_min, cand_max, compared, undefined, pruned, moments);
+}
+
+template <int size, int bpp>
+__attribute__((target("avx2")))
+static void masked_moments_avx2(const uint8_t* pos_pixels, const uint8_t* cand_pixels,
+        defined_bits pos_defined, defined_bits cand_defined,
+        int width, int height, int stride, int bound, patch_moments& moments)
+{
+    if (size) {
+        width  = size;
+        height = size;
+    }
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i minus_one = _mm256_set1_epi32(-1);
+
+    // lanes are channels within each 128 bit half
+    __m256i sum_v = zero, sum_sq_v = zero;
+    __m256i cand_min_v = minus_one, cand_max_v = zero;
+    int sum[4], sum_sq[4];
+    int compared = 0, undefined = 0;
+    bool pruned = false;
+    for (int y=0; y<height && !pruned; ++y) {
+        for (int x0=0; x0<width; x0+=bit_run_size) {
+            uint64_t both_bits = defined_in_both(pos_defined, cand_defined, x0, width,
+                    compared, undefined);
+            int x_end = std::min(width, x0 + bit_run_size);
+            for (int x=x0; x<x_end; x+=8, both_bits >>= 8) {
+                __m256i both = expand_bits_avx2(both_bits);
+
+                __m256i p = _mm256_and_si256(load_pixels_avx2<bpp>(pos_pixels  + bpp*x), both);
+                __m256i c = _mm256_and_si256(load_pixels_avx2<bpp>(cand_pixels + bpp*x), both);
+                __m256i d_lo = _mm256_sub_epi16(_mm256_unpacklo_epi8(p, zero), _mm256_unpacklo_epi8(c, zero));
+                __m256i d_hi = _mm256_sub_epi16(_mm256_unpackhi_epi8(p, zero), _mm256_unpackhi_epi8(c, zero));
+                __m256i a0 = _mm256_unpacklo_epi16(d_lo, zero), b0 = _mm256_unpackhi_epi16(d_lo, zero);
+                __m256i a1 = _mm256_unpacklo_epi16(d_hi, zero), b1 = _mm256_unpackhi_epi16(d_hi, zero);
+                sum_sq_v = _mm256_add_epi32(sum_sq_v, _mm256_add_epi32(
+                        _mm256_add_epi32(_mm256_madd_epi16(a0, a0), _mm256_madd_epi16(b0, b0)),
+                        _mm256_add_epi32(_mm256_madd_epi16(a1, a1), _mm256_madd_epi16(b1, b1))));
+                sum_v = _mm256_add_epi32(sum_v, _mm256_add_epi32(
+                        _mm256_add_epi32(_mm256_madd_epi16(a0, one), _mm256_madd_epi16(b0, one)),
+                        _mm256_add_epi32(_mm256_madd_epi16(a1, one), _mm256_madd_epi16(b1, one))));
+                cand_min_v = _mm256_min_epu8(cand_min_v, _mm256_or_si256(c, _mm256_andnot_si256(both, minus_one)));
+                cand_max_v = _mm256_max_epu8(cand_max_v, c);
+            }
+        }
+        if (y+1 < height) {
+            _mm_storeu_si128((__m128i*)sum, _mm_add_epi32(_mm256_castsi256_si128(sum_v),
+                                                          _mm256_extracti128_si256(sum_v, 1)));
+            _mm_storeu_si128((__m128i*)sum_sq, _mm_add_epi32(_mm256_castsi256_si128(sum_sq_v),
+                                                             _mm256_extracti128_si256(sum_sq_v, 1)));
+            pruned = moments_reach(sum, sum_sq, compared, undefined, bound);
+        }
+        pos_pixels  += bpp*stride;
+        cand_pixels += bpp*stride;
+        pos_defined.row  += pos_defined.stride;
+        cand_defined.row += cand_defined.stride;
+    }
+
+    int cand_min[4], cand_max[4];
+    _mm_storeu_si128((__m128i*)sum, _mm_add_epi32(_mm256_castsi256_si128(sum_v),
+                                                  _mm256_extracti128_si256(sum_v, 1)));
+    _mm_storeu_si128((__m128i*)sum_sq, _mm_add_epi32(_mm256_castsi256_si128(sum_sq_v),
+                                                     _mm256_extracti128_si256(sum_sq_v, 1)));
+    store_range_sse2(_mm_min_epu8(_mm256_castsi256_si128(cand_min_v), _mm256_extracti128_si256(cand_min_v, 1)),
+                     _mm_max_epu8(_mm256_castsi256_si128(cand_max_v), _mm256_extracti128_si256(cand_max_v, 1)),
+                     cand_min, cand_max);
+    store_moments(sum, sum_sq, cand_min, cand_max, compared, undefined, pruned, moments);
+}
+
+template <int size, int bpp>
+static void add_square_kernels(pixel_kernels& kernels, bool avx2)
+{
+    kernels.square_ssd[size]     = avx2 ? masked_ssd_avx2<size, bpp>     : masked_ssd_sse2<size, bpp>;
+    kernels.square_moments[size] = avx2 ? masked_moments_avx2<size, bpp> : masked_moments_sse2<size, bpp>;
+}
+
+template <int bpp>
+static pixel_kernels vector_kernels(bool avx2)
+{
+    pixel_kernels kernels;
+    kernels.ssd     = avx2 ? masked_ssd_avx2<0, bpp>     : masked_ssd_sse2<0, bpp>;
+    kernels.moments = avx2 ? masked_moments_avx2<0, bpp> : masked_moments_sse2<0, bpp>;
+    for (int size=0; size<=max_square_size; ++size) {
+        kernels.square_ssd[size]     = kernels.ssd;
+        kernels.square_moments[size] = kernels.moments;
+    }
+    add_square_kernels<3, bpp>(kernels, avx2);
+    add_square_kernels<5, bpp>(kernels, avx2);
+    add_square_kernels<7, bpp>(kernels, avx2);
+    add_square_kernels<9, bpp>(kernels, avx2);
+    add_square_kernels<11, bpp>(kernels, avx2);
+    add_square_kernels<13, bpp>(kernels, avx2);
+    add_square_kernels<15, bpp>(kernels, avx2);
+    add_square_kernels<17, bpp>(kernels, avx2);
+    add_square_kernels<19, bpp>(kernels, avx2);
+    add_square_kernels<21, bpp>(kernels, avx2);
+    return kernels;
+}
+
+#endif
+
+template <int bpp>
+static pixel_kernels generic_kernels()
+{
+    pixel_kernels kernels;
+    kernels.ssd     = masked_ssd_generic<bpp>;
+    kernels.moments = masked_moments_generic<bpp>;
+    for (int size=0; size<=max_square_size; ++size) {
+        kernels.square_ssd[size]     = kernels.ssd;
+        kernels.square_moments[size] = kernels.moments;
+    }
+    return kernels;
+}
+
+template <int bpp>
+static pixel_kernels select_pixel_kernels(kernel_isa isa)
+{
+#ifdef __SSE2__
+    if (isa != kernels_generic)
+        return vector_kernels<bpp>(isa == kernels_avx2);
+#endif
+    return generic_kernels<bpp>();
+}
+
+static bool supported(kernel_isa isa)
+{
+#ifdef __SSE2__
+    __builtin_cpu_init();
+    return isa != kernels_avx2 || __builtin_cpu_supports("avx2");
+#else
+    return isa == kernels_generic;
+#endif
+}
+
+kernel_isa fastest_kernel_isa()
+{
+    if (supported(kernels_avx2))
+        return kernels_avx2;
+    return supported(kernels_sse2) ? kernels_sse2 : kernels_generic;
+}
+
+pixel_kernels kernels_for_bpp[5] = {
+    pixel_kernels(),
+    select_pixel_kernels<1>(fastest_kernel_isa()),
+    select_pixel_kernels<2>(fastest_kernel_isa()),
+    select_pixel_kernels<3>(fastest_kernel_isa()),
+    select_pixel_kernels<4>(fastest_kernel_isa()),
+};
+
+bool use_kernels(kernel_isa isa)
+{
+    if (!supported(isa))
+        return false;
+    kernels_for_bpp[1] = select_pixel_kernels<1>(isa);
+    kernels_for_bpp[2] = select_pixel_kernels<2>(isa);
+    kernels_for_bpp[3] = select_pixel_kernels<3>(isa);
+    kernels_for_bpp[4] = select_pixel_kernels<4>(isa);
+    return true;
+}
+
+}
@@ -0,0 +1,120 @@
+#ifndef UNUFO_KERNELS_H
+#define UNUFO_KERNELS_H
+
+#include <inttypes.h>
+#include <string.h>
+
+namespace unufo {
+
+/// per-patch counters filled by the comparison kernels
+struct patch_sums
+{
+    int ssd;        // sum of squared channel differences over compared pixels
+    int compared;   // pixels defined both near position and near candidate
+    int undefined;  // pixels undefined near candidate
+    bool pruned;    // comparison stopped early, counters cover only the rows seen
+};
+
+/// per-channel moments of the difference of two patches,
+/// the color adjusted difference follows from them in closed form
+struct patch_moments
+{
+    int sum[4];         // sum of pos - cand over compared pixels
+    int sum_sq[4];      // sum of (pos - cand)^2 over compared pixels
+    int cand_min[4];    // range of candidate channels over compared pixels
+    int cand_max[4];
+    int compared;       // pixels defined both near position and near candidate
+    int undefined;      // pixels undefined near candidate
+    bool pruned;        // stopped early, counters cover only the rows seen
+};
+
+/// which pixels of a patch are defined, one bit per pixel: the first row
+/// starts at bit `bit` of row, the following ones are stride words apart
+struct defined_bits
+{
+    const uint64_t* row;
+    int bit;
+    int stride;
+};
+
+/// pixels of a patch row the kernels take from one bit_run
+const int bit_run_size = 56;
+
+/// at least bit_run_size bits of row starting at bit x,
+/// the 8 bytes from the one holding bit x are read
+inline uint64_t bit_run(const uint64_t* row, int x)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t bits;
+    memcpy(&bits, reinterpret_cast<const uint8_t*>(row) + (x >> 3), sizeof(bits));
+    return bits >> (x & 7);
+#else
+    const uint64_t* word = row + (x >> 6);
+    int shift = x & 63;
+    // shifting by 64 is undefined, the second word is shifted in two steps
+    return (word[0] >> shift) | (word[1] << 1 << (63 - shift));
+#endif
+}
+
+/// compare two patches of width x height pixels in place,
+/// pixels point to the top left corner of each patch,
+/// stride is the row length of the underlying image in pixels.
+/// Each kernel handles pixels of one channel count.
+/// Only pixels defined in both patches contribute to ssd.
+/// The comparison stops after the first row where undefined*max_diff + ssd
+/// reaches bound, the candidate can't beat bound then.
+/// Rows may be over-read by up to simd_padding pixels.
+typedef void (*masked_ssd_fn)(const uint8_t* pos_pixels, const uint8_t* cand_pixels,
+        defined_bits pos_defined, defined_bits cand_defined,
+        int width, int height, int stride, int bound, patch_sums& sums);
+
+/// collect patch_moments of two patches, arguments are as for masked_ssd_fn.
+/// Channels past the channel count of the kernel are reported as 0.
+/// The comparison stops after the first row where undefined*max_diff plus
+/// the smallest adjusted difference the moments allow reaches bound,
+/// that is sum_sq - sum^2/compared per channel.
+typedef void (*masked_moments_fn)(const uint8_t* pos_pixels, const uint8_t* cand_pixels,
+        defined_bits pos_defined, defined_bits cand_defined,
+        int width, int height, int stride, int bound, patch_moments& moments);
+
+/// largest patch size with specialized kernels, comp_size 10
+const int max_square_size = 21;
+
+/// kernels for pixels of one channel count
+struct pixel_kernels
+{
+    masked_ssd_fn ssd;
+    masked_moments_fn moments;
+
+    /// specialized for size x size patches, indexed by size.
+    /// Fixed sizes let the compiler unroll the row and column loops,
+    /// width and height passed to a kernel must both equal its index.
+    /// Sizes without a specialization hold ssd and moments.
+    masked_ssd_fn square_ssd[max_square_size + 1];
+    masked_moments_fn square_moments[max_square_size + 1];
+};
+
+/// instruction sets the kernels are built for
+enum kernel_isa
+{
+    kernels_generic,
+    kernels_sse2,
+    kernels_avx2
+};
+
+/// kernels for 1 to 4 channels, indexed by channel count,
+/// the fastest ones supported by the running CPU unless use_kernels()
+/// chose others
+extern pixel_kernels kernels_for_bpp[5];
+
+/// the fastest instruction set of the build the running CPU supports
+kernel_isa fastest_kernel_isa();
+
+/// make kernels_for_bpp hold the kernels of isa, false if the build or
+/// the running CPU lacks isa. Lets checks compare the instruction sets,
+/// no comparison may run meanwhile
+bool use_kernels(kernel_isa isa);
+
+}
+
+#endif // UNUFO_KERNELS_H
@@ -0,0 +1,60 @@
+#include "unufo_motion.h"
+
+#include <stdlib.h>
+#include <vector>
+
+#include "unufo_consts.h"
+#include "unufo_utils.h"
+
+using namespace std;
+
+namespace unufo {
+
+Coordinates estimate_motion(const Bitmap<uint8_t>& previous, const Coordinates& previous_origin,
+        const Bitmap<uint8_t>& current, const Bitmap<uint8_t>& current_mask,
+        const Coordinates& current_origin, int max_shift)
+{
+    // known points of current, in frame coordinates
+    vector<Coordinates> samples;
+    for (int y=0; y<current.height; y+=motion_sample_step)
+        for (int x=0; x<current.width; x+=motion_sample_step)
+            if (!current_mask.at(x, y)[0])
+                samples.push_back(Coordinates(x, y) + current_origin);
+
+    int depth = min(previous.depth, current.depth);
+    Coordinates best_shift;
+    int64_t best_sum = -1;
+    size_t best_count = 0;
+    for (int dy=-max_shift; dy<=max_shift; ++dy)
+        for (int dx=-max_shift; dx<=max_shift; ++dx) {
+            Coordinates shift(dx, dy);
+            int64_t sum = 0;
+            size_t count = 0;
+            for (size_t i=0; i<samples.size(); ++i) {
+                Coordinates from = samples[i] - shift - previous_origin;
+                if (from.x < 0 || from.y < 0 || from.x >= previous.width || from.y >= previous.height)
+                    continue;
+                const uint8_t* a = previous.at(from);
+                const uint8_t* b = current.at(samples[i] - current_origin);
+                for (int c=0; c<depth; ++c)
+                    sum += abs(a[c] - b[c]);
+                ++count;
+            }
+
+            // shifts seeing less than half of the samples aren't trusted
+            if (2*count < samples.size() || !count)
+                continue;
+            // sum/count < best_sum/best_count without dividing
+            int64_t lhs = sum*int64_t(best_count), rhs = best_sum*int64_t(count);
+            if (best_sum < 0 || lhs < rhs || (lhs == rhs && shift < best_shift)) {
+                best_shift = shift;
+                best_sum = sum;
+                best_count = count;
+            }
+        }
+
+    UNUFO_LOG("estimated motion: (%d, %d)\n", best_shift.x, best_shift.y)
+    return best_shift;
+}
+
+}
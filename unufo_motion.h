@@ -0,0 +1,20 @@
+#ifndef UNUFO_MOTION_H
+#define UNUFO_MOTION_H
+
+#include "unufo_types.h"
+
+namespace unufo {
+
+/// global translation of the content of previous to current, within
+/// max_shift in each direction: the offset giving the smallest mean absolute
+/// difference over a grid of points of current which are zero in
+/// current_mask, ties go to the smaller shift.
+/// Both images are parts of frames of the same size, with their top left
+/// corners at previous_origin and current_origin of the frame
+Coordinates estimate_motion(const Bitmap<uint8_t>& previous, const Coordinates& previous_origin,
+        const Bitmap<uint8_t>& current, const Bitmap<uint8_t>& current_mask,
+        const Coordinates& current_origin, int max_shift);
+
+}
+
+#endif // UNUFO_MOTION_H
@@ -1,6 +1,7 @@
 #include "unufo_patch.h"
 
 #include "unufo_geometry.h"
+#include "unufo_kernels.h"
 #include "unufo_pixel.h"
 
 using namespace std;
@@ -8,9 +9,8 @@ using namespace std;
 namespace unufo {
 
 void transfer_patch(const Bitmap<uint8_t>& data, int bpp,
-        const Bitmap<uint8_t>& confidence_map,
-        const Matrix<Coordinates>& transfer_map,
-        const Matrix<int>& transfer_belief,
+        const StateMap& states,
+        const Matrix<int>& transfer_belief, BitPlane& defined,
         const Coordinates& position, const Coordinates& source,
         int belief, const vector<int>& best_color_diff)
 {
@@ -19,52 +19,106 @@ void transfer_patch(const Bitmap<uint8_t>& data, int bpp,
         data.at(position)[j] = new_color;
     }
     // TODO: better confidence transfer
-    *confidence_map.at(position) = *confidence_map.at(source);
-    *transfer_map.at(position) = source;
+    states.at(position)->confidence = states.at(source)->confidence;
+    states.at(position)->set_source(source);
     *transfer_belief.at(position) = belief;
+    // refinement mostly changes defined points, skip the atomic write then
+    if (!defined.get(position))
+        defined.set(position);
 }
 
-int get_difference_color_adjustment(const Bitmap<uint8_t>& data,
-        const Matrix<int>& transfer_belief,
+// the defined bits of the patch with top left corner at corner
+static inline defined_bits patch_defined(const BitPlane& defined, const Coordinates& corner)
+{
+    defined_bits bits = {defined.row(corner.y), corner.x, defined.stride};
+    return bits;
+}
+
+// The comparison and complexity functions are templates on the patch radius
+// and the channel count, zero meaning the runtime argument is used.
+// patch_kernels holds the instantiations for one run.
+
+// compare the parts of the patches around position and candidate
+// which are inside the image, whole patches of a fixed radius
+// use the kernel specialized for their size
+template <int fixed_radius, int fixed_bpp>
+static inline void compare_patches(const Bitmap<uint8_t>& data,
+        const BitPlane& defined,
+        const Coordinates& position, const Coordinates& candidate,
+        int area_size, int bound, patch_sums& sums)
+{
+    if (fixed_radius)
+        area_size = fixed_radius;
+
+    Coordinates from, to;
+    patch_overlap(data, position, candidate, area_size, from, to);
+    int width = to.x - from.x + 1, height = to.y - from.y + 1;
+
+    const pixel_kernels& kernels = kernels_for_bpp[fixed_bpp ? fixed_bpp : data.depth];
+    masked_ssd_fn kernel = kernels.ssd;
+    if (fixed_radius && width == 2*fixed_radius + 1 && height == 2*fixed_radius + 1)
+        kernel = kernels.square_ssd[2*fixed_radius + 1];
+    kernel(data.at(position + from), data.at(candidate + from),
+            patch_defined(defined, position + from), patch_defined(defined, candidate + from),
+            width, height, data.width, bound, sums);
+}
+
+// as compare_patches, collecting the moments for color adjustment
+template <int fixed_radius, int fixed_bpp>
+static inline void compare_patch_moments(const Bitmap<uint8_t>& data,
+        const BitPlane& defined,
+        const Coordinates& position, const Coordinates& candidate,
+        int area_size, int bound, patch_moments& moments)
+{
+    if (fixed_radius)
+        area_size = fixed_radius;
+
+    Coordinates from, to;
+    patch_overlap(data, position, candidate, area_size, from, to);
+    int width = to.x - from.x + 1, height = to.y - from.y + 1;
+
+    const pixel_kernels& kernels = kernels_for_bpp[fixed_bpp ? fixed_bpp : data.depth];
+    masked_moments_fn kernel = kernels.moments;
+    if (fixed_radius && width == 2*fixed_radius + 1 && height == 2*fixed_radius + 1)
+        kernel = kernels.square_moments[2*fixed_radius + 1];
+    kernel(data.at(position + from), data.at(candidate + from),
+            patch_defined(defined, position + from), patch_defined(defined, candidate + from),
+            width, height, data.width, bound, moments);
+}
+
+template <int fixed_radius, int fixed_bpp>
+static int difference_color_adjustment(const Bitmap<uint8_t>& data,
+        const BitPlane& defined,
         int comp_patch_radius,
         const Coordinates& candidate,
         const Coordinates& position,
         vector<int>& best_color_diff,
         int best, int bpp,
-        int max_adjustment, bool equal_adjustment)
+        int max_adjustment, bool equal_adjustment,
+        difference_counters& counters)
 {
-    int max_defined_size = 4*(2*comp_patch_radius + 1)*(2*comp_patch_radius + 1);
-    int defined_only_near_pos;
+    if (fixed_bpp)
+        bpp = fixed_bpp;
 
-    int accum[4] = {0, 0, 0, 0};
+    ++counters.compared;
 
-    uint8_t defined_near_pos [max_defined_size];
-    uint8_t defined_near_cand[max_defined_size];
+    // one pass collects the moments, the adjusted difference follows from them
+    patch_moments moments;
+    compare_patch_moments<fixed_radius, fixed_bpp>(data, defined, position, candidate,
+            comp_patch_radius, best, moments);
 
-    int compared_count = collect_defined_in_both_areas(data,
-            transfer_belief,
-            position, candidate,
-            comp_patch_radius,
-            defined_near_pos, defined_near_cand,
-            defined_only_near_pos);
+    if (moments.pruned) {
+        ++counters.pruned;
+        return best;
+    }
 
+    int compared_count = moments.compared;
     if (!compared_count)
         return best;
 
-    int sum = defined_only_near_pos*max_diff;
-
-    uint8_t* def_n_p = defined_near_pos;
-    uint8_t* def_n_c = defined_near_cand;
-
-    for (int i=0; i<compared_count; ++i) {
-        for (int j=0; j<4; ++j)
-            accum[j] += (int(def_n_p[j]) - int(def_n_c[j]));
-        def_n_p += 4;
-        def_n_c += 4;
-    }
-
+    int accum[4];
     for(int j=0; j<4; ++j) {
-        accum[j] /= compared_count;
+        accum[j] = moments.sum[j]/compared_count;
         if (accum[j] < -max_adjustment)
             accum[j] = -max_adjustment;
 
@@ -80,18 +134,13 @@ int get_difference_color_adjustment(const Bitmap<uint8_t>& data,
             accum[j] = color_diff_sum/bpp;
     }
 
-    def_n_p = defined_near_pos;
-    def_n_c = defined_near_cand;
-    for (int i=0; i<compared_count; ++i) {
-        for (int j=0; j<4; ++j) {
-            int c = int(def_n_c[j]) + accum[j];
-            // do not allow color clipping
-            if (c < 0 || c > 255)
-                return best;
-            sum += pixel_diff(c, def_n_p[j]);
-        }
-        def_n_p += 4;
-        def_n_c += 4;
+    // sum of (p - c - a)^2 = sum_sq - 2*a*sum + n*a^2
+    int sum = moments.undefined*max_diff;
+    for (int j=0; j<4; ++j) {
+        // do not allow color clipping
+        if (moments.cand_min[j] + accum[j] < 0 || moments.cand_max[j] + accum[j] > 255)
+            return best;
+        sum += moments.sum_sq[j] - 2*accum[j]*moments.sum[j] + compared_count*accum[j]*accum[j];
     }
 
     if (sum < best)
@@ -99,62 +148,77 @@ int get_difference_color_adjustment(const Bitmap<uint8_t>& data,
     return sum;
 }
 
-int get_difference(const Bitmap<uint8_t>& data,
-        const Matrix<int>& transfer_belief,
+template <int fixed_radius, int fixed_bpp>
+static int difference(const Bitmap<uint8_t>& data,
+        const BitPlane& defined,
         int comp_patch_radius,
         const Coordinates& candidate,
-        const Coordinates& position, int best)
+        const Coordinates& position, int best,
+        difference_counters& counters)
 {
-    int max_defined_size = 4*(2*comp_patch_radius + 1)*(2*comp_patch_radius + 1);
-    int defined_only_near_pos;
-
-    uint8_t defined_near_pos [max_defined_size];
-    uint8_t defined_near_cand[max_defined_size];
-
-    int compared_count = collect_defined_in_both_areas(data,
-            transfer_belief,
-            position, candidate,
-            comp_patch_radius,
-            defined_near_pos, defined_near_cand,
-            defined_only_near_pos);
-
-    if (compared_count) {
-        int sum = defined_only_near_pos*max_diff;
-
-        uint8_t* def_n_p = defined_near_pos;
-        uint8_t* def_n_c = defined_near_cand;
-        for (; compared_count; --compared_count) {
-            for (int j=0; j<4; ++j) {
-                sum += pixel_diff(def_n_c[j], def_n_p[j]);
-            }
+    patch_sums sums;
+    compare_patches<fixed_radius, fixed_bpp>(data, defined, position, candidate, comp_patch_radius, best, sums);
 
-            def_n_p += 4;
-            def_n_c += 4;
-        }
+    ++counters.compared;
+    if (sums.pruned)
+        ++counters.pruned;
 
-        return sum;
-    } else
+    if (sums.compared)
+        return sums.undefined*max_diff + sums.ssd;
+    else
         return best;
 }
 
-int get_complexity(const Bitmap<uint8_t>& data,
-        const Bitmap<uint8_t>& confidence_map,
-        const Matrix<int>& transfer_belief,
+// reciprocals of the spatial weights 1+ox*ox+oy*oy of get_complexity,
+// (n*at[oy][ox]) >> 32 equals n/weight for all n up to 255*255
+template <int radius>
+struct weight_reciprocals
+{
+    uint64_t at[2*radius + 1][2*radius + 1];
+
+    weight_reciprocals() {
+        for (int oy=-radius; oy<=radius; ++oy)
+            for (int ox=-radius; ox<=radius; ++ox)
+                at[oy + radius][ox + radius] = (uint64_t(1) << 32)/(1 + ox*ox + oy*oy) + 1;
+    }
+
+    static const weight_reciprocals table;
+};
+
+template <int radius>
+const weight_reciprocals<radius> weight_reciprocals<radius>::table;
+
+template <int fixed_radius, int fixed_bpp>
+static int complexity(const Bitmap<uint8_t>& data,
+        const StateMap& states,
+        const BitPlane& defined,
         const Coordinates& point, int comp_patch_radius,
         int bpp)
 {
+    if (fixed_radius)
+        comp_patch_radius = fixed_radius;
+    if (fixed_bpp)
+        bpp = fixed_bpp;
+
     // TODO: improve complexity metric
     int confidence_sum = 0;
     int defined_count = 0;
+    Coordinates last_defined;
+
+    // no clipping needed for points away from the border
+    bool inside = point.x >= comp_patch_radius && point.y >= comp_patch_radius &&
+        point.x + comp_patch_radius < data.width && point.y + comp_patch_radius < data.height;
 
     // get mean color
-    Coordinates defined_points[comp_patch_radius*comp_patch_radius*4 + comp_patch_radius*4 + 1];
     for (int ox=-comp_patch_radius; ox<=comp_patch_radius; ++ox)
         for (int oy=-comp_patch_radius; oy<=comp_patch_radius; ++oy) {
             Coordinates point_off = point + Coordinates(ox, oy);
-            if (clip(data, point_off) && *transfer_belief.at(point_off)>=0) {
-                confidence_sum += *confidence_map.at(point_off);
-                defined_points[defined_count++] = point_off;
+            if (inside || clip(data, point_off)) {
+                // defined points are unpredictable, keep this free of branches
+                int point_defined = defined.get(point_off);
+                confidence_sum += states.at(point_off)->confidence & -point_defined;
+                defined_count += point_defined;
+                last_defined = point_defined ? point_off : last_defined;
             }
         }
 
@@ -162,26 +226,29 @@ int get_complexity(const Bitmap<uint8_t>& data,
         return -1;
     }
 
-    int mean_values[bpp];
+    // TODO: this is the color of the last defined point, not the mean
+    int mean_values[4];
+    const uint8_t* colors = data.at(last_defined);
     for (int j = 0; j<bpp; ++j)
-        mean_values[j] = 0;
-    for (int i = 0; i<defined_count; ++i) {
-        uint8_t* colors = data.at(defined_points[i]);
-        for (int j = 0; j<bpp; ++j)
-            mean_values[j] = colors[j];
-    }
+        mean_values[j] = colors[j];
 
     // compute local deviation
     // spatial weight function is 1/(1+sqared_distance_from_point)
-    int weighted_dev;
-    for (int ox=-comp_patch_radius; ox<=comp_patch_radius; ++ox)
-        for (int oy=-comp_patch_radius; oy<=comp_patch_radius; ++oy) {
+    int weighted_dev = 0;
+    for (int oy=-comp_patch_radius; oy<=comp_patch_radius; ++oy)
+        for (int ox=-comp_patch_radius; ox<=comp_patch_radius; ++ox) {
             Coordinates point_off = point + Coordinates(ox, oy);
-            if (clip(data, point_off) && *confidence_map.at(point_off))
+            if (inside || clip(data, point_off)) {
+                int confident = -(states.at(point_off)->confidence != 0);
                 for (int j = 0; j<bpp; ++j) {
                     int d = (data.at(point_off)[j] - mean_values[j]);
-                    weighted_dev += d*d/(1+ox*ox+oy*oy);
+                    if (fixed_radius)
+                        weighted_dev += int((uint64_t(d*d)*weight_reciprocals<fixed_radius>::table.
+                                at[oy + fixed_radius][ox + fixed_radius]) >> 32) & confident;
+                    else
+                        weighted_dev += d*d/(1+ox*ox+oy*oy) & confident;
                 }
+            }
         }
 
     // multiply by average confidence among defined points
@@ -190,5 +257,79 @@ int get_complexity(const Bitmap<uint8_t>& data,
     return weighted_dev;
 }
 
+int get_difference_color_adjustment(const Bitmap<uint8_t>& data,
+        const BitPlane& defined,
+        int comp_patch_radius,
+        const Coordinates& candidate,
+        const Coordinates& position,
+        vector<int>& best_color_diff,
+        int best, int bpp,
+        int max_adjustment, bool equal_adjustment,
+        difference_counters& counters)
+{
+    return difference_color_adjustment<0, 0>(data, defined, comp_patch_radius,
+            candidate, position, best_color_diff, best, bpp,
+            max_adjustment, equal_adjustment, counters);
+}
+
+int get_difference(const Bitmap<uint8_t>& data,
+        const BitPlane& defined,
+        int comp_patch_radius,
+        const Coordinates& candidate,
+        const Coordinates& position, int best,
+        difference_counters& counters)
+{
+    return difference<0, 0>(data, defined, comp_patch_radius,
+            candidate, position, best, counters);
+}
+
+int get_complexity(const Bitmap<uint8_t>& data,
+        const StateMap& states,
+        const BitPlane& defined,
+        const Coordinates& point, int comp_patch_radius,
+        int bpp)
+{
+    return complexity<0, 0>(data, states, defined,
+            point, comp_patch_radius, bpp);
+}
+
+template <int fixed_radius, int fixed_bpp>
+static patch_kernels fixed_patch_kernels()
+{
+    patch_kernels kernels;
+    kernels.difference = difference<fixed_radius, fixed_bpp>;
+    kernels.difference_color_adjustment = difference_color_adjustment<fixed_radius, fixed_bpp>;
+    kernels.complexity = complexity<fixed_radius, fixed_bpp>;
+    return kernels;
+}
+
+template <int fixed_radius>
+static patch_kernels select_bpp_kernels(int bpp)
+{
+    switch (bpp) {
+    case 1: return fixed_patch_kernels<fixed_radius, 1>();
+    case 2: return fixed_patch_kernels<fixed_radius, 2>();
+    case 3: return fixed_patch_kernels<fixed_radius, 3>();
+    case 4: return fixed_patch_kernels<fixed_radius, 4>();
+    default: return fixed_patch_kernels<fixed_radius, 0>();
+    }
+}
+
+patch_kernels select_patch_kernels(int comp_patch_radius, int bpp)
+{
+    switch (comp_patch_radius) {
+    case 1:  return select_bpp_kernels<1>(bpp);
+    case 2:  return select_bpp_kernels<2>(bpp);
+    case 3:  return select_bpp_kernels<3>(bpp);
+    case 4:  return select_bpp_kernels<4>(bpp);
+    case 5:  return select_bpp_kernels<5>(bpp);
+    case 6:  return select_bpp_kernels<6>(bpp);
+    case 7:  return select_bpp_kernels<7>(bpp);
+    case 8:  return select_bpp_kernels<8>(bpp);
+    case 9:  return select_bpp_kernels<9>(bpp);
+    case 10: return select_bpp_kernels<10>(bpp);
+    default: return select_bpp_kernels<0>(bpp);
+    }
 }
 
+}
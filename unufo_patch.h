@@ -1,36 +1,94 @@
+#ifndef UNUFO_PATCH_H
+#define UNUFO_PATCH_H
+
 #include <vector>
 
 #include "unufo_types.h"
 
 namespace unufo {
 
+/// number of candidates scored by get_difference*,
+/// pruned ones were dropped early as they couldn't beat the best one
+struct difference_counters
+{
+    uint64_t compared;
+    uint64_t pruned;
+
+    difference_counters(): compared(0), pruned(0) {}
+
+    difference_counters& operator+=(const difference_counters& other) {
+        compared += other.compared;
+        pruned   += other.pruned;
+        return *this;
+    }
+};
+
 void transfer_patch(const Bitmap<uint8_t>& data, int bpp,
-        const Bitmap<uint8_t>& confidence_map,
-        const Matrix<Coordinates>& transfer_map,
-        const Matrix<int>& transfer_belief,
+        const StateMap& states,
+        const Matrix<int>& transfer_belief, BitPlane& defined,
         const Coordinates& position, const Coordinates& source,
         int belief, const std::vector<int>& best_color_diff);
 
 int get_difference_color_adjustment(const Bitmap<uint8_t>& data,
-        const Matrix<int>& transfer_belief,
+        const BitPlane& defined,
         int comp_patch_radius,
         const Coordinates& candidate,
         const Coordinates& position,
         std::vector<int>& best_color_diff,
         int best, int bpp,
-        int max_adjustment, bool equal_adjustment);
+        int max_adjustment, bool equal_adjustment,
+        difference_counters& counters);
 
 int get_difference(const Bitmap<uint8_t>& data,
-        const Matrix<int>& transfer_belief,
+        const BitPlane& defined,
         int comp_patch_radius,
         const Coordinates& candidate,
-        const Coordinates& position, int best);
+        const Coordinates& position, int best,
+        difference_counters& counters);
 
 /// return structural complexity of point's neighbourhood
 int get_complexity(const Bitmap<uint8_t>& data,
-        const Bitmap<uint8_t>& confidence_map,
-        const Matrix<int>& transfer_belief,
+        const StateMap& states,
+        const BitPlane& defined,
         const Coordinates& point, int comp_patch_radius, int bpp);
 
+typedef int (*difference_fn)(const Bitmap<uint8_t>& data,
+        const BitPlane& defined,
+        int comp_patch_radius,
+        const Coordinates& candidate,
+        const Coordinates& position, int best,
+        difference_counters& counters);
+
+typedef int (*difference_color_adjustment_fn)(const Bitmap<uint8_t>& data,
+        const BitPlane& defined,
+        int comp_patch_radius,
+        const Coordinates& candidate,
+        const Coordinates& position,
+        std::vector<int>& best_color_diff,
+        int best, int bpp,
+        int max_adjustment, bool equal_adjustment,
+        difference_counters& counters);
+
+typedef int (*complexity_fn)(const Bitmap<uint8_t>& data,
+        const StateMap& states,
+        const BitPlane& defined,
+        const Coordinates& point, int comp_patch_radius, int bpp);
+
+/// get_difference, get_difference_color_adjustment and get_complexity
+/// compiled for one patch radius and channel count.
+/// They take the same arguments, radius and bpp must be the ones
+/// the kernels were selected for.
+struct patch_kernels
+{
+    difference_fn difference;
+    difference_color_adjustment_fn difference_color_adjustment;
+    complexity_fn complexity;
+};
+
+/// kernels specialized for comp_patch_radius 1 to 10 and 1 to 4 channels,
+/// the generic functions for other values
+patch_kernels select_patch_kernels(int comp_patch_radius, int bpp);
+
 }
 
+#endif // UNUFO_PATCH_H
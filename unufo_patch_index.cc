@@ -0,0 +1,227 @@
+#include "unufo_patch_index.h"
+
+#include <algorithm>
+#include <queue>
+#include <utility>
+
+#include "unufo_consts.h"
+#include "unufo_geometry.h"
+
+using namespace std;
+
+namespace unufo {
+
+// 3x3 cells, then channel means
+static const int descriptor_cells = 9;
+
+// first offset of every cell along one axis of a patch, and the end of the last one
+static void cell_bounds(int radius, int bounds[4])
+{
+    int side = 2*radius + 1;
+    for (int c=0; c<4; ++c)
+        bounds[c] = (c*side + 2)/3 - radius;
+}
+
+static inline int cell_of(int offset, int radius)
+{
+    return (offset + radius)*3/(2*radius + 1);
+}
+
+struct by_dimension
+{
+    const vector<float>& descriptors;
+    int dimensions, dimension;
+
+    bool operator()(int a, int b) const {
+        return descriptors[a*dimensions + dimension] < descriptors[b*dimensions + dimension];
+    }
+};
+
+void patch_index::build(const Bitmap<uint8_t>& data, const Bitmap<uint8_t>& mask,
+        int bpp, int comp_patch_radius, const vector<Coordinates>& points)
+{
+    bpp_ = bpp;
+    radius_ = comp_patch_radius;
+    dimensions_ = descriptor_cells + bpp;
+    points_.clear();
+    descriptors_.clear();
+    order_.clear();
+    nodes_.clear();
+
+    // summed area tables of channels and of masked points
+    int width = data.width + 1;
+    Matrix<int64_t> channel_sums[4];
+    Matrix<int> masked_sums;
+    for (int j=0; j<bpp; ++j)
+        channel_sums[j].resize(width, data.height + 1);
+    masked_sums.resize(width, data.height + 1);
+    for (int y=0; y<data.height; ++y)
+        for (int x=0; x<data.width; ++x) {
+            for (int j=0; j<bpp; ++j)
+                *channel_sums[j].at(x+1, y+1) = data.at(x, y)[j]
+                    + *channel_sums[j].at(x, y+1) + *channel_sums[j].at(x+1, y)
+                    - *channel_sums[j].at(x, y);
+            *masked_sums.at(x+1, y+1) = (mask.at(x, y)[0] != 0)
+                + *masked_sums.at(x, y+1) + *masked_sums.at(x+1, y)
+                - *masked_sums.at(x, y);
+        }
+
+    int bounds[4];
+    cell_bounds(radius_, bounds);
+    int side = 2*radius_ + 1;
+
+    for (size_t i=0; i<points.size(); ++i) {
+        const Coordinates& p = points[i];
+        if (p.x - radius_ < 0 || p.y - radius_ < 0 ||
+            p.x + radius_ >= data.width || p.y + radius_ >= data.height)
+            continue;
+
+        int x1 = p.x - radius_, y1 = p.y - radius_;
+        int x2 = p.x + radius_ + 1, y2 = p.y + radius_ + 1;
+        if (*masked_sums.at(x2, y2) - *masked_sums.at(x1, y2)
+                - *masked_sums.at(x2, y1) + *masked_sums.at(x1, y1))
+            continue;
+
+        points_.push_back(p);
+        for (int cy=0; cy<3; ++cy)
+            for (int cx=0; cx<3; ++cx) {
+                int cx1 = p.x + bounds[cx], cx2 = p.x + bounds[cx+1];
+                int cy1 = p.y + bounds[cy], cy2 = p.y + bounds[cy+1];
+                int64_t sum = 0;
+                for (int j=0; j<bpp; ++j)
+                    sum += *channel_sums[j].at(cx2, cy2) - *channel_sums[j].at(cx1, cy2)
+                        - *channel_sums[j].at(cx2, cy1) + *channel_sums[j].at(cx1, cy1);
+                descriptors_.push_back(float(sum)/(bpp*(cx2 - cx1)*(cy2 - cy1)));
+            }
+        for (int j=0; j<bpp; ++j)
+            descriptors_.push_back(float(*channel_sums[j].at(x2, y2) - *channel_sums[j].at(x1, y2)
+                - *channel_sums[j].at(x2, y1) + *channel_sums[j].at(x1, y1))/(side*side));
+    }
+
+    for (size_t i=0; i<points_.size(); ++i)
+        order_.push_back(i);
+    if (!points_.empty())
+        build_node(0, points_.size());
+}
+
+int patch_index::build_node(int begin, int end)
+{
+    int index = nodes_.size();
+    nodes_.push_back(node());
+    nodes_[index].split_dimension = -1;
+    nodes_[index].begin = begin;
+    nodes_[index].end = end;
+    if (end - begin <= ann_leaf_size)
+        return index;
+
+    // split the widest dimension at the median
+    int split_dimension = 0;
+    float widest = -1;
+    for (int d=0; d<dimensions_; ++d) {
+        float lo = descriptor(order_[begin])[d], hi = lo;
+        for (int i=begin+1; i<end; ++i) {
+            lo = min(lo, descriptor(order_[i])[d]);
+            hi = max(hi, descriptor(order_[i])[d]);
+        }
+        if (hi - lo > widest) {
+            widest = hi - lo;
+            split_dimension = d;
+        }
+    }
+
+    int middle = (begin + end)/2;
+    by_dimension compare = {descriptors_, dimensions_, split_dimension};
+    nth_element(order_.begin() + begin, order_.begin() + middle, order_.begin() + end, compare);
+
+    nodes_[index].split_dimension = split_dimension;
+    nodes_[index].split_value = descriptor(order_[middle])[split_dimension];
+    int left = build_node(begin, middle);
+    int right = build_node(middle, end);
+    nodes_[index].left = left;
+    nodes_[index].right = right;
+    return index;
+}
+
+void patch_index::query(const Bitmap<uint8_t>& data, const BitPlane& defined,
+        const Coordinates& position, int k, vector<Coordinates>& result) const
+{
+    result.clear();
+    if (points_.empty() || k <= 0)
+        return;
+
+    // describe the known part of the patch
+    int cell_sums[descriptor_cells] = {0};
+    int cell_counts[descriptor_cells] = {0};
+    int channel_sums[4] = {0, 0, 0, 0};
+    int known = 0;
+    for (int oy=-radius_; oy<=radius_; ++oy)
+        for (int ox=-radius_; ox<=radius_; ++ox) {
+            Coordinates point = position + Coordinates(ox, oy);
+            if (!clip(data, point) || !defined.get(point))
+                continue;
+            int cell = cell_of(oy, radius_)*3 + cell_of(ox, radius_);
+            const uint8_t* pixel = data.at(point);
+            for (int j=0; j<bpp_; ++j) {
+                cell_sums[cell] += pixel[j];
+                channel_sums[j] += pixel[j];
+            }
+            ++cell_counts[cell];
+            ++known;
+        }
+    if (!known)
+        return;
+
+    float q[descriptor_cells + 4];
+    int total = 0;
+    for (int j=0; j<bpp_; ++j)
+        total += channel_sums[j];
+    // unknown cells look like the average of the known ones
+    for (int c=0; c<descriptor_cells; ++c)
+        q[c] = cell_counts[c] ? float(cell_sums[c])/(bpp_*cell_counts[c])
+                              : float(total)/(bpp_*known);
+    for (int j=0; j<bpp_; ++j)
+        q[descriptor_cells + j] = float(channel_sums[j])/known;
+
+    // best bin first: visit the most promising leaves, at most ann_max_leaves
+    typedef pair<float, int> entry;
+    priority_queue<entry, vector<entry>, greater<entry>> branches;
+    priority_queue<entry> nearest;
+    branches.push(entry(0, 0));
+    for (int leaves=0; !branches.empty() && leaves < ann_max_leaves; ++leaves) {
+        entry branch = branches.top();
+        branches.pop();
+        if (int(nearest.size()) == k && branch.first >= nearest.top().first)
+            break;
+
+        int n = branch.second;
+        while (nodes_[n].split_dimension >= 0) {
+            const node& inner = nodes_[n];
+            float diff = q[inner.split_dimension] - inner.split_value;
+            int near_child = diff < 0 ? inner.left : inner.right;
+            int far_child  = diff < 0 ? inner.right : inner.left;
+            branches.push(entry(max(branch.first, diff*diff), far_child));
+            n = near_child;
+        }
+
+        for (int i=nodes_[n].begin; i<nodes_[n].end; ++i) {
+            const float* d = descriptor(order_[i]);
+            float distance = 0;
+            for (int j=0; j<dimensions_; ++j)
+                distance += (d[j] - q[j])*(d[j] - q[j]);
+            if (int(nearest.size()) < k) {
+                nearest.push(entry(distance, order_[i]));
+            } else if (distance < nearest.top().first) {
+                nearest.pop();
+                nearest.push(entry(distance, order_[i]));
+            }
+        }
+    }
+
+    result.resize(nearest.size());
+    for (int i=result.size()-1; i>=0; --i) {
+        result[i] = points_[nearest.top().second];
+        nearest.pop();
+    }
+}
+
+}
@@ -0,0 +1,53 @@
+#ifndef UNUFO_PATCH_INDEX_H
+#define UNUFO_PATCH_INDEX_H
+
+#include <vector>
+
+#include "unufo_types.h"
+
+namespace unufo {
+
+/// approximate nearest neighbour index over source patches.
+/// A patch is described by the mean intensity of a 3x3 grid of cells
+/// covering it followed by the mean of every channel, descriptors are
+/// kept in a kd-tree searched best bin first.
+class patch_index
+{
+public:
+    patch_index(): bpp_(0), radius_(0), dimensions_(0) {}
+
+    /// index patches around points, patches touching a masked point
+    /// or the image border are skipped, they are never fully known
+    void build(const Bitmap<uint8_t>& data, const Bitmap<uint8_t>& mask,
+            int bpp, int comp_patch_radius, const std::vector<Coordinates>& points);
+
+    bool empty() const { return points_.empty(); }
+
+    /// up to k indexed points whose patches look like the one around
+    /// position, only its defined points are considered
+    void query(const Bitmap<uint8_t>& data, const BitPlane& defined,
+            const Coordinates& position, int k, std::vector<Coordinates>& result) const;
+
+private:
+    struct node
+    {
+        int split_dimension;    // -1 for leaves
+        float split_value;
+        int left, right;        // children
+        int begin, end;         // range of order_ covered by a leaf
+    };
+
+    int build_node(int begin, int end);
+
+    const float* descriptor(int point) const { return &descriptors_[point*dimensions_]; }
+
+    int bpp_, radius_, dimensions_;
+    std::vector<Coordinates> points_;
+    std::vector<float> descriptors_;
+    std::vector<int> order_;
+    std::vector<node> nodes_;
+};
+
+}
+
+#endif // UNUFO_PATCH_INDEX_H
@@ -0,0 +1,199 @@
+#include "unufo_pnm.h"
+
+#include <algorithm>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "unufo_utils.h"
+
+namespace unufo {
+
+// skip whitespace and comments between PNM header fields
+static void skip_space(FILE* f)
+{
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        if (c == '#') {
+            while ((c = fgetc(f)) != EOF && c != '\n')
+                ;
+        } else if (!isspace(c)) {
+            ungetc(c, f);
+            return;
+        }
+    }
+}
+
+static bool read_pnm_header(FILE* f, int& width, int& height, int& maxval)
+{
+    skip_space(f);
+    if (fscanf(f, "%d", &width) != 1)
+        return false;
+    skip_space(f);
+    if (fscanf(f, "%d", &height) != 1)
+        return false;
+    skip_space(f);
+    if (fscanf(f, "%d", &maxval) != 1)
+        return false;
+    // exactly one whitespace character separates header from raster
+    return isspace(fgetc(f));
+}
+
+static bool read_pam_header(FILE* f, int& width, int& height, int& depth, int& maxval)
+{
+    char line[256];
+    width = height = depth = maxval = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, "ENDHDR", 6))
+            return true;
+        if (sscanf(line, "WIDTH %d", &width) == 1 ||
+            sscanf(line, "HEIGHT %d", &height) == 1 ||
+            sscanf(line, "DEPTH %d", &depth) == 1 ||
+            sscanf(line, "MAXVAL %d", &maxval) == 1)
+            continue;
+        // TUPLTYPE and comments are ignored, channels are taken as they are
+    }
+    return false;
+}
+
+bool pnm_reader::open(const char* filename)
+{
+    close();
+    file_ = fopen(filename, "rb");
+    if (!file_) {
+        UNUFO_LOG("can't open %s\n", filename)
+        return false;
+    }
+
+    char magic[3] = {0, 0, 0};
+    int maxval;
+    bool header_ok = false;
+    if (fread(magic, 1, 2, file_) == 2 && magic[0] == 'P') {
+        switch (magic[1]) {
+        case '5':
+            bpp = 1;
+            header_ok = read_pnm_header(file_, width, height, maxval);
+            break;
+        case '6':
+            bpp = 3;
+            header_ok = read_pnm_header(file_, width, height, maxval);
+            break;
+        case '7':
+            header_ok = read_pam_header(file_, width, height, bpp, maxval);
+            break;
+        }
+    }
+
+    if (!header_ok || maxval != 255 || bpp < 1 || bpp > 4 ||
+        width <= 0 || height <= 0)
+    {
+        UNUFO_LOG("%s is not an 8 bit PGM, PPM or PAM file\n", filename)
+        close();
+        return false;
+    }
+    // a row has to fit a Bitmap
+    if (int64_t(width)*bpp > max_bitmap_size) {
+        UNUFO_LOG("rows of %s are too long\n", filename)
+        close();
+        return false;
+    }
+
+    raster_offset_ = ftello(file_);
+    return true;
+}
+
+void pnm_reader::close()
+{
+    if (file_)
+        fclose(file_);
+    file_ = NULL;
+}
+
+bool pnm_reader::read(const Rectangle& rect, Bitmap<uint8_t>& image)
+{
+    if (int64_t(rect.width())*rect.height()*bpp > max_bitmap_size) {
+        UNUFO_LOG("(%d, %d) pixels are too many to read at once\n", rect.width(), rect.height())
+        return false;
+    }
+    image.resize(rect.width(), rect.height(), bpp);
+
+    // whole rows are contiguous in the file, one seek is enough for them
+    bool whole_rows = rect.x1 == 0 && rect.x2 == width;
+    for (int y=0; y<image.height; ++y) {
+        if (!y || !whole_rows) {
+            off_t offset = raster_offset_ + (off_t(rect.y1 + y)*width + rect.x1)*bpp;
+            if (fseeko(file_, offset, SEEK_SET))
+                return false;
+        }
+        if (fread(image.at(0, y), bpp, image.width, file_) != size_t(image.width)) {
+            UNUFO_LOG("raster is truncated\n")
+            return false;
+        }
+    }
+    return true;
+}
+
+bool pnm_reader::read_rows(int y1, int y2, uint8_t* rows)
+{
+    size_t row_size = size_t(width)*bpp;
+    if (fseeko(file_, raster_offset_ + off_t(y1)*row_size, SEEK_SET))
+        return false;
+    if (fread(rows, row_size, y2 - y1, file_) != size_t(y2 - y1)) {
+        UNUFO_LOG("raster is truncated\n")
+        return false;
+    }
+    return true;
+}
+
+// bytes copied per band by write_pnm_patched(), at least one row
+static const size_t patched_band_size = 1 << 20;
+
+static void write_header(FILE* f, int width, int height, int bpp)
+{
+    if (bpp == 1 || bpp == 3) {
+        fprintf(f, "P%d\n%d %d\n255\n", bpp == 1 ? 5 : 6, width, height);
+    } else {
+        static const char* const tuple_types[] = {
+            "", "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"};
+        fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+                width, height, bpp, tuple_types[bpp]);
+    }
+}
+
+bool write_pnm_patched(const char* filename, pnm_reader& source,
+        const Bitmap<uint8_t>& patch, int x1, int y1)
+{
+    std::string temp_filename = std::string(filename) + ".tmp";
+    FILE* f = fopen(temp_filename.c_str(), "wb");
+    if (!f) {
+        UNUFO_LOG("can't open %s for writing\n", temp_filename.c_str())
+        return false;
+    }
+
+    write_header(f, source.width, source.height, source.bpp);
+
+    // offsets into the band are size_t, the image may exceed what a Bitmap holds
+    size_t row_size = size_t(source.width)*source.bpp;
+    int band_rows = std::min<size_t>(source.height, std::max<size_t>(1, patched_band_size/row_size));
+    std::vector<uint8_t> band(row_size*band_rows);
+    bool ok = true;
+    for (int y=0; ok && y<source.height; y+=band_rows) {
+        int rows = std::min(band_rows, source.height - y);
+        ok = source.read_rows(y, y + rows, band.data());
+        int patch_y1 = std::max(y, y1), patch_y2 = std::min(y + rows, y1 + patch.height);
+        for (int py=patch_y1; ok && py<patch_y2; ++py)
+            memcpy(&band[size_t(py - y)*row_size + size_t(x1)*source.bpp],
+                    patch.at(0, py - y1), size_t(patch.width)*patch.depth);
+        ok = ok && fwrite(band.data(), row_size, rows, f) == size_t(rows);
+    }
+
+    if (fclose(f) || !ok || rename(temp_filename.c_str(), filename)) {
+        remove(temp_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+}
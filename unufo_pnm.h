@@ -0,0 +1,52 @@
+#ifndef UNUFO_PNM_H
+#define UNUFO_PNM_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "unufo_types.h"
+
+namespace unufo {
+
+/// binary PGM (P5), PPM (P6) or PAM (P7) file with maxval 255 whose raster
+/// is read a rectangle at a time, so large images needn't be held whole
+class pnm_reader
+{
+public:
+    pnm_reader(): width(0), height(0), bpp(0), file_(NULL), raster_offset_(0) {}
+    ~pnm_reader() { close(); }
+
+    /// read the header, false if the file can't be opened or isn't supported
+    bool open(const char* filename);
+    void close();
+
+    /// read the part of the image covered by rect, which must lie inside it,
+    /// into image, false as well if it has more than max_bitmap_size elements
+    bool read(const Rectangle& rect, Bitmap<uint8_t>& image);
+
+    /// read the raster of rows [y1, y2) into rows, which holds
+    /// (y2 - y1)*width*bpp bytes
+    bool read_rows(int y1, int y2, uint8_t* rows);
+
+    int width, height;
+    /// number of channels
+    int bpp;
+
+private:
+    FILE* file_;
+    off_t raster_offset_;
+
+    pnm_reader(const pnm_reader&);
+    pnm_reader& operator=(const pnm_reader&);
+};
+
+/// write the image of source with patch in place of the pixels at (x1, y1),
+/// the rest is copied from source in bands of rows.
+/// filename is replaced only once it is complete, so it may be the file
+/// source reads from.
+bool write_pnm_patched(const char* filename, pnm_reader& source,
+        const Bitmap<uint8_t>& patch, int x1, int y1);
+
+}
+
+#endif // UNUFO_PNM_H
@@ -0,0 +1,68 @@
+#include "unufo_pyramid.h"
+
+#include "unufo_geometry.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace unufo {
+
+void downsample(const Bitmap<uint8_t>& image, const Bitmap<uint8_t>& mask,
+        Bitmap<uint8_t>& coarse_image, Bitmap<uint8_t>& coarse_mask)
+{
+    static const int weights[4] = {1, 3, 3, 1};
+
+    int width  = (image.width  + 1)/2;
+    int height = (image.height + 1)/2;
+    coarse_image.resize(width, height, image.depth);
+    coarse_mask.resize(width, height, 1);
+
+    for (int y=0; y<height; ++y)
+        for (int x=0; x<width; ++x) {
+            // masked if any of the four covered points is masked
+            uint8_t masked = 0;
+            for (int fy=2*y; fy<min(2*y+2, image.height); ++fy)
+                for (int fx=2*x; fx<min(2*x+2, image.width); ++fx)
+                    masked = max(masked, mask.at(fx, fy)[0]);
+            coarse_mask.at(x, y)[0] = masked;
+
+            // filter over the 4x4 neighbourhood, skipping points to be filled
+            int accum[4] = {0, 0, 0, 0};
+            int weight_sum = 0;
+            for (int i=0; i<4; ++i) {
+                int fy = 2*y - 1 + i;
+                if (fy < 0 || fy >= image.height)
+                    continue;
+                for (int j=0; j<4; ++j) {
+                    int fx = 2*x - 1 + j;
+                    if (fx < 0 || fx >= image.width || mask.at(fx, fy)[0])
+                        continue;
+                    int w = weights[i]*weights[j];
+                    const uint8_t* pixel = image.at(fx, fy);
+                    for (int k=0; k<image.depth; ++k)
+                        accum[k] += w*pixel[k];
+                    weight_sum += w;
+                }
+            }
+            if (weight_sum)
+                for (int k=0; k<image.depth; ++k)
+                    coarse_image.at(x, y)[k] = (accum[k] + weight_sum/2)/weight_sum;
+        }
+}
+
+void downsample_reference(const Bitmap<uint8_t>& ref_layer, Bitmap<uint8_t>& coarse_ref_layer)
+{
+    int width  = (ref_layer.width  + 1)/2;
+    int height = (ref_layer.height + 1)/2;
+    coarse_ref_layer.resize(width, height, 1);
+
+    for (int y=0; y<height; ++y)
+        for (int x=0; x<width; ++x)
+            for (int fy=2*y; fy<min(2*y+2, ref_layer.height); ++fy)
+                for (int fx=2*x; fx<min(2*x+2, ref_layer.width); ++fx)
+                    if (is_reference_point(ref_layer, fx, fy))
+                        coarse_ref_layer.at(x, y)[0] = 255;
+}
+
+}
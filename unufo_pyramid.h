@@ -0,0 +1,20 @@
+#ifndef UNUFO_PYRAMID_H
+#define UNUFO_PYRAMID_H
+
+#include "unufo_types.h"
+
+namespace unufo {
+
+/// halve image with a [1 3 3 1] binomial filter using only points
+/// which are zero in mask, a coarse point is masked if any of its
+/// four fine points is masked
+void downsample(const Bitmap<uint8_t>& image, const Bitmap<uint8_t>& mask,
+        Bitmap<uint8_t>& coarse_image, Bitmap<uint8_t>& coarse_mask);
+
+/// halve reference layer, a coarse point is a reference point
+/// if any of its four fine points is
+void downsample_reference(const Bitmap<uint8_t>& ref_layer, Bitmap<uint8_t>& coarse_ref_layer);
+
+}
+
+#endif // UNUFO_PYRAMID_H
@@ -0,0 +1,58 @@
+#ifndef UNUFO_RANDOM_H
+#define UNUFO_RANDOM_H
+
+#include <inttypes.h>
+
+namespace unufo {
+
+inline uint64_t splitmix64(uint64_t& state)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/// xoshiro128** generator, cheap enough to set up one per parallel task
+/// so the numbers drawn don't depend on which thread runs the task
+class random_generator
+{
+public:
+    explicit random_generator(uint64_t seed) {
+        uint64_t a = splitmix64(seed), b = splitmix64(seed);
+        s_[0] = a; s_[1] = a >> 32;
+        s_[2] = b; s_[3] = b >> 32;
+    }
+
+    /// independent stream for the key-th task of a loop seeded with seed
+    random_generator(uint64_t seed, uint64_t key) {
+        uint64_t mixed = seed ^ key*0xd1342543de82ef95ULL;
+        *this = random_generator(splitmix64(mixed));
+    }
+
+    uint32_t operator()() {
+        uint32_t result = rotl(s_[1]*5, 7)*9;
+        uint32_t t = s_[1] << 9;
+        s_[2] ^= s_[0];
+        s_[3] ^= s_[1];
+        s_[1] ^= s_[2];
+        s_[0] ^= s_[3];
+        s_[2] ^= t;
+        s_[3] = rotl(s_[3], 11);
+        return result;
+    }
+
+    /// uniform in [0, n)
+    int below(int n) {
+        return (uint64_t((*this)())*uint32_t(n)) >> 32;
+    }
+
+private:
+    static uint32_t rotl(uint32_t x, int k) { return (x << k) | (x >> (32 - k)); }
+
+    uint32_t s_[4];
+};
+
+}
+
+#endif // UNUFO_RANDOM_H
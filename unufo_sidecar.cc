@@ -0,0 +1,164 @@
+#include "unufo_sidecar.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "unufo_utils.h"
+
+namespace unufo {
+
+// layout, all fields little endian: magic, image width and height as
+// 32 bits, image hash as 64 bits, selection, corpus and field bounds as
+// 4 times 32 bits each, then the source of every point of the field
+// bounds, row by row, as two 16 bit coordinates
+static const char sidecar_magic[8] = {'U', 'N', 'U', 'F', 'O', 'N', 'F', '2'};
+
+static const int header_size = 8 + 2*4 + 8 + 3*4*4;
+// the header up to the field bounds identifies the heal
+static const int key_size = header_size - 4*4;
+
+static uint8_t* put_le(uint8_t* out, uint64_t value, int bytes)
+{
+    for (int i=0; i<bytes; ++i)
+        out[i] = uint8_t(value >> 8*i);
+    return out + bytes;
+}
+
+static const uint8_t* get_le(const uint8_t* in, uint64_t& value, int bytes)
+{
+    value = 0;
+    for (int i=0; i<bytes; ++i)
+        value |= uint64_t(in[i]) << 8*i;
+    return in + bytes;
+}
+
+static uint8_t* put_rectangle(uint8_t* out, const Rectangle& rect)
+{
+    out = put_le(out, uint32_t(rect.x1), 4);
+    out = put_le(out, uint32_t(rect.y1), 4);
+    out = put_le(out, uint32_t(rect.x2), 4);
+    return put_le(out, uint32_t(rect.y2), 4);
+}
+
+static const uint8_t* get_rectangle(const uint8_t* in, Rectangle& rect)
+{
+    uint64_t x1, y1, x2, y2;
+    in = get_le(in, x1, 4);
+    in = get_le(in, y1, 4);
+    in = get_le(in, x2, 4);
+    in = get_le(in, y2, 4);
+    rect = Rectangle(int32_t(x1), int32_t(y1), int32_t(x2), int32_t(y2));
+    return in;
+}
+
+// the key part of the header
+static void put_key(uint8_t* out, uint64_t image_hash, int width, int height,
+        const Rectangle& selection, const Rectangle& corpus)
+{
+    memcpy(out, sidecar_magic, sizeof(sidecar_magic));
+    out += sizeof(sidecar_magic);
+    out = put_le(out, uint32_t(width), 4);
+    out = put_le(out, uint32_t(height), 4);
+    out = put_le(out, image_hash, 8);
+    out = put_rectangle(out, selection);
+    put_rectangle(out, corpus);
+}
+
+uint64_t hash_bytes(const uint8_t* data, size_t size, uint64_t hash)
+{
+    // eight bytes a step, taken as a little endian word
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        get_le(data + i, word, 8);
+        hash = (hash ^ word)*0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 32;
+    }
+    for (; i<size; ++i) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool write_field_sidecar(const char* filename, uint64_t image_hash,
+        int width, int height, const Rectangle& selection, const Rectangle& corpus,
+        const source_field& field)
+{
+    if (width > max_state_map_side || height > max_state_map_side) {
+        UNUFO_LOG("image too large for a field sidecar: (%d, %d)\n", width, height)
+        return false;
+    }
+
+    FILE* f = fopen(filename, "wb");
+    if (!f) {
+        UNUFO_LOG("can't open %s for writing\n", filename)
+        return false;
+    }
+
+    uint8_t header[header_size];
+    put_key(header, image_hash, width, height, selection, corpus);
+    put_rectangle(header + key_size, field.bounds);
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+
+    std::vector<uint8_t> row(4*field.bounds.width());
+    for (int y=field.bounds.y1; ok && y<field.bounds.y2; ++y) {
+        uint8_t* out = row.data();
+        for (int x=field.bounds.x1; x<field.bounds.x2; ++x) {
+            const Coordinates& source = field.at(Coordinates(x, y));
+            out = put_le(out, uint16_t(source.x), 2);
+            out = put_le(out, uint16_t(source.y), 2);
+        }
+        ok = fwrite(row.data(), 1, row.size(), f) == row.size();
+    }
+
+    return !fclose(f) && ok;
+}
+
+bool read_field_sidecar(const char* filename, uint64_t image_hash,
+        int width, int height, const Rectangle& selection, const Rectangle& corpus,
+        source_field& field)
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+        return false;
+
+    uint8_t header[header_size], key[key_size];
+    put_key(key, image_hash, width, height, selection, corpus);
+    Rectangle bounds;
+    bool valid = fread(header, sizeof(header), 1, f) == 1 && !memcmp(header, key, key_size);
+    if (valid) {
+        get_rectangle(header + key_size, bounds);
+        valid = bounds.x1 >= 0 && bounds.y1 >= 0 && bounds.x1 <= bounds.x2 &&
+            bounds.y1 <= bounds.y2 && bounds.x2 <= width && bounds.y2 <= height;
+    }
+    if (!valid) {
+        UNUFO_LOG("%s is not a field of this heal\n", filename)
+        fclose(f);
+        return false;
+    }
+
+    field.reset(bounds);
+    std::vector<uint8_t> row(4*field.bounds.width());
+    bool ok = true;
+    for (int y=field.bounds.y1; ok && y<field.bounds.y2; ++y) {
+        ok = fread(row.data(), 1, row.size(), f) == row.size();
+        const uint8_t* in = row.data();
+        for (int x=field.bounds.x1; ok && x<field.bounds.x2; ++x) {
+            uint64_t source_x, source_y;
+            in = get_le(in, source_x, 2);
+            in = get_le(in, source_y, 2);
+            field.at(Coordinates(x, y)) = Coordinates(source_x, source_y);
+        }
+    }
+    fclose(f);
+
+    if (!ok) {
+        UNUFO_LOG("field in %s is truncated\n", filename)
+        return false;
+    }
+    return true;
+}
+
+}
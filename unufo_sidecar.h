@@ -0,0 +1,33 @@
+#ifndef UNUFO_SIDECAR_H
+#define UNUFO_SIDECAR_H
+
+#include <stddef.h>
+
+#include "unufo_synth.h"
+#include "unufo_types.h"
+
+namespace unufo {
+
+/// hash of the first state, continued over size bytes of data by hash_bytes()
+const uint64_t hash_seed = 14695981039346656037ULL;
+
+/// hash of data continued from hash, FNV-1a style over 8 byte words
+uint64_t hash_bytes(const uint8_t* data, size_t size, uint64_t hash);
+
+/// save field of a heal of selection from corpus in a width x height image
+/// whose content hashes to image_hash. The file is the same on any host,
+/// sources are stored in 16 bits, so the image sides may not exceed
+/// max_state_map_side
+bool write_field_sidecar(const char* filename, uint64_t image_hash,
+        int width, int height, const Rectangle& selection, const Rectangle& corpus,
+        const source_field& field);
+
+/// load a field saved by write_field_sidecar(), false if filename
+/// can't be read or was saved for another image, selection or corpus
+bool read_field_sidecar(const char* filename, uint64_t image_hash,
+        int width, int height, const Rectangle& selection, const Rectangle& corpus,
+        source_field& field);
+
+}
+
+#endif // UNUFO_SIDECAR_H
@@ -0,0 +1,76 @@
+#include "unufo_stats.h"
+
+#include <inttypes.h>
+
+namespace unufo {
+
+void synthesis_stats::clear()
+{
+    total_seconds = 0;
+    pyramid_seconds = 0;
+    frontier_seconds = 0;
+    search_seconds = 0;
+    refinement_seconds = 0;
+    final_refinement_seconds = 0;
+    threads = 0;
+    components = 0;
+    seeded_points = 0;
+    compared = 0;
+    pruned = 0;
+    converge_count = 0;
+    total_belief = 0;
+    deadline_hit = false;
+    peak_memory_kb = 0;
+    levels.clear();
+    iterations.clear();
+    passes.clear();
+}
+
+void write_stats_json(FILE* file, const synthesis_stats& stats)
+{
+    fprintf(file, "{\"seconds\": {\"total\": %.6f, \"pyramid\": %.6f, \"frontier\": %.6f, "
+            "\"search\": %.6f, \"refinement\": %.6f, \"final_refinement\": %.6f}",
+            stats.total_seconds, stats.pyramid_seconds, stats.frontier_seconds,
+            stats.search_seconds, stats.refinement_seconds, stats.final_refinement_seconds);
+    fprintf(file, ", \"threads\": %d", stats.threads);
+    fprintf(file, ", \"components\": %d", stats.components);
+    fprintf(file, ", \"seeded_points\": %d", stats.seeded_points);
+    fprintf(file, ", \"comparisons\": {\"compared\": %" PRIu64 ", \"pruned\": %" PRIu64 "}",
+            stats.compared, stats.pruned);
+    fprintf(file, ", \"converge_count\": %d", stats.converge_count);
+    fprintf(file, ", \"total_belief\": %" PRId64, stats.total_belief);
+    fprintf(file, ", \"deadline_hit\": %s", stats.deadline_hit ? "true" : "false");
+    fprintf(file, ", \"peak_memory_kb\": %ld", stats.peak_memory_kb);
+
+    fprintf(file, ", \"levels\": [");
+    for (size_t i=0; i<stats.levels.size(); ++i) {
+        const level_stats& l = stats.levels[i];
+        fprintf(file, "%s{\"level\": %d, \"width\": %d, \"height\": %d, "
+                "\"points\": %d, \"points_left\": %d, \"seconds\": %.6f}",
+                i ? ", " : "", l.level, l.width, l.height, l.points, l.points_left, l.seconds);
+    }
+
+    fprintf(file, "], \"iterations\": [");
+    for (size_t i=0; i<stats.iterations.size(); ++i) {
+        const fill_stats& f = stats.iterations[i];
+        fprintf(file, "%s{\"level\": %d, \"frontier\": %d, \"searched\": %d, \"filled\": %d, "
+                "\"refine_passes\": %d, \"converged\": %s}",
+                i ? ", " : "", f.level, f.frontier_size, f.searched, f.filled,
+                f.refine_passes, f.converged ? "true" : "false");
+    }
+
+    fprintf(file, "], \"passes\": [");
+    for (size_t i=0; i<stats.passes.size(); ++i) {
+        const pass_stats& p = stats.passes[i];
+        fprintf(file, "%s{\"level\": %d, \"final\": %s, \"pass\": %d, \"runs\": %" PRIu64
+                ", \"points\": %" PRIu64 ", \"active_points\": %" PRIu64
+                ", \"coherence_improvements\": %" PRIu64
+                ", \"random_improvements\": %" PRIu64 ", \"unchanged_runs\": %" PRIu64 "}",
+                i ? ", " : "", p.level, p.final_pass ? "true" : "false", p.pass, p.runs,
+                p.points, p.active_points, p.coherence_improvements, p.random_improvements,
+                p.unchanged_runs);
+    }
+    fprintf(file, "]}");
+}
+
+}
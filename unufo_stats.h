@@ -0,0 +1,92 @@
+#ifndef UNUFO_STATS_H
+#define UNUFO_STATS_H
+
+#include <stdio.h>
+#include <vector>
+
+#include "unufo_types.h"
+
+namespace unufo {
+
+/// one pyramid level
+struct level_stats
+{
+    int level;
+    int width, height;
+    int points;                 // points to fill
+    int points_left;            // points the fill loop couldn't reach
+    double seconds;
+};
+
+/// one iteration of the fill loop
+struct fill_stats
+{
+    int level;
+    int frontier_size;          // edge points before taking the batch
+    int searched;               // points of the batch searched for
+    int filled;                 // points filled, with their transfer blocks
+    int refine_passes;          // refinement passes run on the batch
+    bool converged;             // passes stopped early as nothing changed
+};
+
+/// refinement passes with the same index in their sequence, summed
+struct pass_stats
+{
+    int level;
+    bool final_pass;            // run over the whole selection after filling
+    int pass;
+    uint64_t runs;
+    uint64_t points;
+    uint64_t active_points;     // points refined, the rest had no changes nearby
+    uint64_t coherence_improvements;
+    uint64_t random_improvements;
+    uint64_t unchanged_runs;    // runs which didn't improve any point
+};
+
+/// what one synthesize() call spent its time on
+struct synthesis_stats
+{
+    // phase timings in seconds, the phases don't cover setup
+    // and are summed over the jobs of a split selection
+    double total_seconds;
+    double pyramid_seconds;     // downsampling, upsampling and index building
+    double frontier_seconds;    // keeping the edge frontier
+    double search_seconds;      // global search for the edge points
+    double refinement_seconds;  // refinement inside the fill loop
+    double final_refinement_seconds;
+
+    int threads;
+    // jobs the selection was filled in, see Parameters::split_components
+    int components;
+    // points which started from the source of an initial field
+    int seeded_points;
+
+    // patch comparisons, pruned ones stopped early as they couldn't win
+    uint64_t compared;
+    uint64_t pruned;
+
+    // fill loop iterations whose refinement converged early
+    int converge_count;
+
+    // sum of the beliefs of the filled points, lower is a better match
+    int64_t total_belief;
+    // refinement was stopped by Parameters::time_budget_ms
+    bool deadline_hit;
+
+    // high-water mark of the process resident set
+    long peak_memory_kb;
+
+    std::vector<level_stats> levels;
+    std::vector<fill_stats> iterations;
+    std::vector<pass_stats> passes;
+
+    synthesis_stats() { clear(); }
+    void clear();
+};
+
+/// write stats as one JSON object without a trailing newline
+void write_stats_json(FILE* file, const synthesis_stats& stats);
+
+}
+
+#endif // UNUFO_STATS_H
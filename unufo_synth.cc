@@ -0,0 +1,1689 @@
+/*
+   The Resynthesizer - A GIMP plug-in for resynthesizing textures
+   Copyright (C) 2000 2008  Paul Francis Harrison
+   Copyright (C) 2002  Laurent Despeyroux
+   Copyright (C) 2002  David Rodríguez García
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+#include "unufo_synth.h"
+
+#include <algorithm>
+#include <atomic>
+#include <limits.h>
+#include <memory>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <thread>
+#include <time.h>
+#include <utility>
+#include <vector>
+
+#include "unufo_consts.h"
+#include "unufo_frontier.h"
+#include "unufo_geometry.h"
+#include "unufo_patch.h"
+#include "unufo_patch_index.h"
+#include "unufo_pyramid.h"
+#include "unufo_random.h"
+#include "unufo_thread_pool.h"
+#include "unufo_utils.h"
+
+using namespace std;
+
+namespace unufo {
+
+// work done by refinement passes
+struct refine_counters
+{
+    difference_counters comparisons;
+    uint64_t coherence_improvements;
+    uint64_t random_improvements;
+    uint64_t active;    // points refined, the others were skipped
+
+    refine_counters(): coherence_improvements(0), random_improvements(0), active(0) {}
+
+    refine_counters& operator+=(const refine_counters& other) {
+        comparisons += other.comparisons;
+        active      += other.active;
+        coherence_improvements += other.coherence_improvements;
+        random_improvements    += other.random_improvements;
+        return *this;
+    }
+};
+
+// points grouped into square tiles in four phases by tile parity,
+// tiles of one phase are a whole tile apart, so the neighbourhoods their
+// points propagate from never overlap and they can be refined concurrently
+struct refine_schedule
+{
+    vector<vector<Coordinates>> phases[4];
+};
+
+// mask value of the points of other components in the mask of a component
+// job, the points the job fills are 255
+static const uint8_t held_mask_value = 1;
+
+// state of one synthesis, the implementation of synthesis_context
+class synthesizer
+{
+public:
+    explicit synthesizer(thread_pool* shared_pool);
+
+    void configure(const Parameters& parameters, int bpp, progress_callback progress);
+    bool run(Bitmap<uint8_t>& image, Bitmap<uint8_t>& image_mask,
+            const Bitmap<uint8_t>* ref_layer,
+            const Rectangle& selection, const Rectangle& corpus,
+            const source_field* initial);
+
+    synthesis_stats run_stats;
+    source_field result_field;
+
+private:
+    bool try_point(const Bitmap<uint8_t>& image, const BitPlane& image_defined,
+            const Coordinates& candidate, const Coordinates& position,
+            int& best, Coordinates& best_point, vector<int>& best_color_diff,
+            difference_counters& counters);
+    bool try_point(const Coordinates& candidate, const Coordinates& position,
+            int& best, Coordinates& best_point, vector<int>& best_color_diff,
+            difference_counters& counters) {
+        return try_point(data, defined, candidate, position,
+                best, best_point, best_color_diff, counters);
+    }
+    Coordinates search(int n, const Coordinates& position,
+            difference_counters& counters, random_generator& random);
+    bool refine_point(const Coordinates& position, vector<int>& color_diff,
+            refine_counters& counters, random_generator& random, bool from_snapshot);
+    void refine_transfer(const Coordinates& position, const Coordinates& source,
+            int belief, const vector<int>& color_diff, bool from_snapshot);
+    bool refine_pass(const vector<Coordinates>& points, bool backward,
+            refine_counters& counters);
+    bool refine_pass_by_gain(const vector<Coordinates>& points, refine_counters& counters);
+    void build_refine_schedule(const vector<Coordinates>& points, refine_schedule& schedule);
+    void clear_changes(const vector<Coordinates>& points, uint8_t changes);
+    void take_snapshot();
+    void update_snapshot(const vector<vector<Coordinates>>& tiles);
+    bool refine_pass_parallel(const refine_schedule& schedule, bool backward,
+            refine_counters& counters);
+    bool active(const Coordinates& position) const;
+    bool past_deadline() const;
+    bool run_refine_pass(const vector<Coordinates>& points, const refine_schedule& schedule,
+            bool backward, bool first, pass_stats& stats);
+    void report_progress(float fraction);
+    void upsample_sources(const StateMap& coarse_states, const vector<Coordinates>& data_points);
+    void seed_sources(const source_field& field, const vector<Coordinates>& data_points);
+    void score_sources(const vector<Coordinates>& seeded);
+    // offsets of the points of a transfer block from its center
+    int block_begin() const { return -(transfer_size - 1)/2; }
+    int block_end() const   { return transfer_size/2 + 1; }
+    void drop_covered_points(vector<Coordinates>& points, vector<Coordinates>& skipped,
+            Bitmap<uint8_t>& claimed);
+    void transfer_block(const Coordinates& position, const Coordinates& source,
+            vector<Coordinates>& filled, difference_counters& counters);
+    void synthesize_level(int level, const Bitmap<uint8_t>* ref_layer,
+            const StateMap* coarse_states);
+    Rectangle level_corpus(const Rectangle& corpus, int level, int width, int height) const;
+    bool has_sources(const Bitmap<uint8_t>& mask, const Bitmap<uint8_t>* ref_layer,
+            const Rectangle& level_corpus) const;
+    bool fill(Bitmap<uint8_t>& image, Bitmap<uint8_t>& image_mask,
+            const Bitmap<uint8_t>* ref_layer,
+            const Rectangle& selection, const Rectangle& corpus);
+    bool run_components(Bitmap<uint8_t>& image, const Bitmap<uint8_t>& image_mask,
+            const Bitmap<uint8_t>* ref_layer,
+            const Rectangle& selection, const Rectangle& corpus);
+    uint64_t draw_seed();
+
+    Parameters parameters;
+
+    // run on one component of a split selection, the points of the mask
+    // which are held_mask_value belong to other components
+    bool component_job;
+
+    int input_bytes;
+    int comp_patch_radius;
+
+    // comparison functions specialized for comp_patch_radius and input_bytes
+    patch_kernels kernels;
+
+    bool equal_adjustment;
+    int max_adjustment;
+
+    bool use_ref_layer;
+
+    // side of the block of points filled by one search, 1 for single points
+    int transfer_size;
+
+    // candidates taken from source_index by the global search, 0 if it isn't used
+    int ann_candidates;
+
+    // we must fill selection subset of data
+    // using ref_points or the corpus region of data for inspiration
+    // status holds current state of point filling
+    Bitmap<uint8_t> data, data_mask;
+    int sel_x1, sel_y1, sel_x2, sel_y2;
+
+    // data_points is a queue of points to be filled,
+    // it can contain duplicates, which mean points re-analysis
+    //
+    // sorted_offsets is an array of points near origin, beginning with (0,0)
+    // and sorted by distance from origin (see Coordinates::operator< for 
+    // current definition of 'distance')
+    vector<Coordinates> ref_points;
+    patch_index source_index;
+
+    int best;
+    Coordinates best_point;
+    vector<int> best_color_diff;
+
+    // source, confidence and flags of every point, beliefs are kept apart,
+    // an int next to the 6 bytes of a PointState would pad it to 12
+    StateMap states;
+    Matrix<int> transfer_belief;
+    // points with a belief, ground truth or filled, as packed bits for the kernels
+    BitPlane defined;
+
+    // data, defined and confidences as they were at the start of the current
+    // phase of parallel refinement, all reads of other points come from here
+    // while the threads write their own points to data, defined and states
+    Bitmap<uint8_t> phase_data;
+    BitPlane phase_defined;
+    Matrix<uint8_t> phase_confidence;
+
+    // refinement passes of the level are counted from 1 in pass_stamp,
+    // the points a pass changes get the point_changed flag of its parity.
+    // A pass only refines points which changed or have a neighbour which
+    // changed in it or in the previous pass, unless all_active is set
+    int pass_stamp;
+    bool all_active;
+
+    // clock_seconds() at which refinement stops, 0 without a time budget
+    double deadline;
+
+    // field the current run starts from, NULL for none
+    const source_field* initial_field;
+
+    // patch comparisons of the current run
+    difference_counters search_counters;
+
+    // serial code draws from rng, parallel loops derive per-task streams from it
+    random_generator rng;
+
+    progress_callback progress;
+    // share of the overall progress covered by the current pyramid level
+    float progress_begin, progress_span;
+
+    // pool runs the parallel loops, it is own_pool unless shared,
+    // own_pool is kept between runs and rebuilt only when the thread count changes
+    thread_pool* pool;
+    unique_ptr<thread_pool> own_pool;
+};
+
+// seconds since an arbitrary point, for phase timings
+static double clock_seconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+uint64_t synthesizer::draw_seed()
+{
+    uint64_t seed = rng();
+    return seed << 32 | rng();
+}
+
+synthesizer::synthesizer(thread_pool* shared_pool):
+    component_job(false), input_bytes(0), comp_patch_radius(0),
+    equal_adjustment(false), max_adjustment(0), use_ref_layer(false),
+    transfer_size(1), ann_candidates(0),
+    sel_x1(0), sel_y1(0), sel_x2(0), sel_y2(0),
+    best(0), pass_stamp(0), all_active(true), deadline(0), initial_field(NULL), rng(0), progress(NULL), progress_begin(0), progress_span(1),
+    pool(shared_pool)
+{
+}
+
+// compare the patches around candidate and position in image
+inline bool synthesizer::try_point(const Bitmap<uint8_t>& image,
+                                   const BitPlane& image_defined,
+                                   const Coordinates& candidate,
+                                   const Coordinates& position,
+                                   int& best,
+                                   Coordinates& best_point,
+                                   vector<int>& best_color_diff,
+                                   difference_counters& counters)
+{
+    int difference;
+    if (max_adjustment)
+        difference = kernels.difference_color_adjustment(image,
+            image_defined, comp_patch_radius,
+            candidate, position, best_color_diff, best,
+            input_bytes, max_adjustment, equal_adjustment, counters);
+    else
+        difference = kernels.difference(image,
+            image_defined, comp_patch_radius,
+            candidate, position, best, counters);
+
+    if (best <= difference)
+        return false;
+    best = difference;
+    best_point = candidate;
+    return true;
+}
+
+// best of the candidates of the global search for position,
+// n random tries unless source_index is used
+Coordinates synthesizer::search(int n, const Coordinates& position,
+        difference_counters& counters, random_generator& random)
+{
+    // thread local vars
+    int tl_best{INT_MAX};
+    Coordinates tl_best_point;
+    vector<int> tl_best_color_diff{0, 0, 0, 0};
+
+    // rank the closest indexed patches exactly
+    if (!source_index.empty()) {
+        vector<Coordinates> candidates;
+        source_index.query(data, defined, position, ann_candidates, candidates);
+        for (size_t j=0; j<candidates.size(); ++j)
+            try_point(candidates[j], position, tl_best, tl_best_point, tl_best_color_diff, counters);
+        if (!candidates.empty())
+            return tl_best_point;
+    }
+
+    // TODO: unify these branches, use ref_points with border
+    // bonus point: this will fix the FIXME dozen lines below
+    if (use_ref_layer) {
+        int ref_points_size{int(ref_points.size())};
+        if (n < ref_points_size) { // random guesses
+            for (int j=0; j<n; ++j) {
+                const Coordinates& candidate{ref_points[random.below(ref_points_size)]};
+                try_point(candidate, position, tl_best, tl_best_point, tl_best_color_diff, counters);
+            }
+        } else { // exhaustive search
+            for (int j=0; j<ref_points_size; ++j) {
+                const Coordinates& candidate{ref_points[j]};
+                try_point(candidate, position, tl_best, tl_best_point, tl_best_color_diff, counters);
+            }
+        }
+    } else {
+        for (int j=0; j<n; ++j) {
+            int x, y;
+            // FIXME: this will suck with large rectangular selections with small borders
+            do {
+                x = sel_x1 + random.below(sel_x2 - sel_x1);
+                y = sel_y1 + random.below(sel_y2 - sel_y1);
+            } while (states.at(x,y)->selected());
+            try_point(Coordinates(x, y), position, tl_best, tl_best_point, tl_best_color_diff, counters);
+        }
+    }
+
+    return tl_best_point;
+}
+
+// give position the source and color of a better match found by refinement,
+// from_snapshot takes the source pixel and confidence from the phase snapshot
+void synthesizer::refine_transfer(const Coordinates& position, const Coordinates& source,
+        int belief, const vector<int>& color_diff, bool from_snapshot)
+{
+    if (!from_snapshot) {
+        transfer_patch(data, input_bytes,
+                states, transfer_belief, defined,
+                position, source, belief, color_diff);
+        return;
+    }
+
+    for (int j=0; j<input_bytes; ++j)
+        data.at(position)[j] = phase_data.at(source)[j] + color_diff[j];
+    states.at(position)->confidence = *phase_confidence.at(source);
+    states.at(position)->set_source(source);
+    *transfer_belief.at(position) = belief;
+    // other threads set bits of the same words
+    defined.set(position);
+}
+
+// try to improve the source of position by coherence propagation
+// from neighbours and by random search around the current source,
+// returns true if its source or color changed.
+// from_snapshot compares patches in the phase snapshot, for parallel passes
+bool synthesizer::refine_point(const Coordinates& position, vector<int>& color_diff,
+                               refine_counters& counters, random_generator& random,
+                               bool from_snapshot)
+{
+    const Bitmap<uint8_t>& image = from_snapshot ? phase_data : data;
+    const BitPlane& image_defined = from_snapshot ? phase_defined : defined;
+
+    bool improved = false;
+    int best = INT_MAX;
+    Coordinates best_point = states.at(position)->source();
+
+    Coordinates old_source = best_point;
+    uint8_t old_pixel[4];
+    memcpy(old_pixel, data.at(position), input_bytes);
+
+    // coherence propagation
+    for (int ox=-1; ox<=1; ++ox)
+        for (int oy=-1; oy<=1; ++oy) {
+            Coordinates offset(ox, oy);
+            Coordinates neighbour = position + offset;
+            if (clip(data, neighbour)) {
+                const PointState& neighbour_state = *states.at(neighbour);
+                if (neighbour_state.selected() && neighbour_state.has_source()) {
+                    Coordinates near_neighbour_src = neighbour_state.source() - offset;
+                    if (clip(data, near_neighbour_src) &&
+                        try_point(image, image_defined, near_neighbour_src, position,
+                                  best, best_point, color_diff, counters.comparisons))
+                    {
+                        refine_transfer(position, best_point, best, color_diff, from_snapshot);
+                        ++counters.coherence_improvements;
+                        improved = true;
+                    }
+                }
+            }
+        }
+
+    // random search
+    int search_range = max(data.width, data.height);
+    while (search_range > 0) {
+        int ox = random.below(search_range);
+        int oy = random.below(search_range);
+        Coordinates offset(ox, oy);
+        Coordinates near_src = states.at(position)->source() + offset;
+        // the mask tells unselected points, their states may be written
+        // by other threads of a parallel pass
+        if ((ox||oy) && clip(data, near_src) && !data_mask.at(near_src)[0]) {
+            int best = *transfer_belief.at(position);
+            Coordinates best_point = states.at(position)->source();
+            if (try_point(image, image_defined, near_src - offset,
+                position, best, best_point, color_diff, counters.comparisons))
+            {
+                refine_transfer(position, best_point, best, color_diff, from_snapshot);
+                ++counters.random_improvements;
+                improved = true;
+            }
+        }
+        search_range /= 2;
+    }
+
+    // coherence propagation transfers the best neighbour's offer even if
+    // it is the source the point already has, only real changes count
+    bool changed = improved && (states.at(position)->source_x != old_source.x ||
+                                states.at(position)->source_y != old_source.y ||
+                                memcmp(data.at(position), old_pixel, input_bytes));
+    if (changed)
+        states.at(position)->flags |= point_changed << (pass_stamp & 1);
+    return changed;
+}
+
+// whether position or one of its neighbours changed in this or the previous
+// pass, otherwise refining it again can't propagate anything
+inline bool synthesizer::active(const Coordinates& position) const
+{
+    if (all_active)
+        return true;
+    const uint8_t changes = point_changed | point_changed << 1;
+    int x1 = max(position.x - 1, 0), x2 = min(position.x + 1, data.width - 1);
+    int y1 = max(position.y - 1, 0), y2 = min(position.y + 1, data.height - 1);
+    for (int y=y1; y<=y2; ++y)
+        for (int x=x1; x<=x2; ++x)
+            if (states.at(x, y)->flags & changes)
+                return true;
+    return false;
+}
+
+// drop the changes flags of points, refinement only changes the points
+// of its passes, so a sequence of passes over points leaves its changes there
+void synthesizer::clear_changes(const vector<Coordinates>& points, uint8_t changes)
+{
+    for (size_t i=0; i<points.size(); ++i)
+        states.at(points[i])->flags &= ~changes;
+}
+
+// points between deadline checks of a refinement loop
+static const int deadline_check_interval = 64;
+
+inline bool synthesizer::past_deadline() const
+{
+    return deadline && clock_seconds() > deadline;
+}
+
+// one refinement pass over points in given order,
+// returns true if nothing changed
+bool synthesizer::refine_pass(const vector<Coordinates>& points, bool backward,
+                              refine_counters& counters)
+{
+    if (deadline)
+        return refine_pass_by_gain(points, counters);
+
+    int points_size = points.size();
+    int i_begin = backward ? points_size-1 : 0;
+    int i_end   = backward ? -1 : points_size;
+    int i_inc   = backward ? -1 : 1;
+
+    bool converged = true;
+    for(int i=i_begin; i != i_end; i+=i_inc) {
+        if (!active(points[i]))
+            continue;
+        ++counters.active;
+        if (refine_point(points[i], best_color_diff, counters, rng, false))
+            converged = false;
+    }
+    return converged;
+}
+
+// refinement pass for a time budget: the active points are refined worst
+// match first, as they have the most to gain, until the deadline.
+// Returns true if nothing changed
+bool synthesizer::refine_pass_by_gain(const vector<Coordinates>& points,
+                                      refine_counters& counters)
+{
+    vector<pair<int, Coordinates>> ordered;
+    for (size_t i=0; i<points.size(); ++i)
+        if (active(points[i]))
+            ordered.push_back(make_pair(*transfer_belief.at(points[i]), points[i]));
+    stable_sort(ordered.begin(), ordered.end(),
+            [](const pair<int, Coordinates>& a, const pair<int, Coordinates>& b) {
+                return a.first > b.first;
+            });
+
+    bool converged = true;
+    for (size_t i=0; i<ordered.size(); ++i) {
+        if (!(i % deadline_check_interval) && past_deadline())
+            return false;
+        ++counters.active;
+        if (refine_point(ordered[i].second, best_color_diff, counters, rng, false))
+            converged = false;
+    }
+    return converged;
+}
+
+void synthesizer::build_refine_schedule(const vector<Coordinates>& points, refine_schedule& schedule)
+{
+    int tile_size = max(refine_tile_size, comp_patch_radius + 1);
+    int tiles_x = (data.width  + tile_size - 1)/tile_size;
+    int tiles_y = (data.height + tile_size - 1)/tile_size;
+
+    // keep the scan order of points inside every tile
+    vector<vector<Coordinates>> tiles(tiles_x*tiles_y);
+    for (size_t i=0; i<points.size(); ++i)
+        tiles[points[i].y/tile_size*tiles_x + points[i].x/tile_size].push_back(points[i]);
+
+    for (int ty=0; ty<tiles_y; ++ty)
+        for (int tx=0; tx<tiles_x; ++tx) {
+            vector<Coordinates>& tile = tiles[ty*tiles_x + tx];
+            if (!tile.empty()) {
+                vector<vector<Coordinates>>& phase = schedule.phases[(ty%2)*2 + tx%2];
+                phase.push_back(vector<Coordinates>());
+                phase.back().swap(tile);
+            }
+        }
+}
+
+// snapshot of the whole of data, defined and the confidences
+void synthesizer::take_snapshot()
+{
+    phase_data.crop_from(data, Rectangle(0, 0, data.width, data.height));
+    phase_defined.copy_from(defined);
+    phase_confidence.resize(data.width, data.height);
+    for (int y=0; y<data.height; ++y)
+        for (int x=0; x<data.width; ++x)
+            *phase_confidence.at(x, y) = states.at(x, y)->confidence;
+}
+
+// bring the points of tiles up to date in the snapshot
+void synthesizer::update_snapshot(const vector<vector<Coordinates>>& tiles)
+{
+    for (size_t i=0; i<tiles.size(); ++i)
+        for (size_t j=0; j<tiles[i].size(); ++j) {
+            const Coordinates& position = tiles[i][j];
+            memcpy(phase_data.at(position), data.at(position), input_bytes);
+            if (defined.get(position) && !phase_defined.get(position))
+                phase_defined.set(position);
+            *phase_confidence.at(position) = states.at(position)->confidence;
+        }
+}
+
+// refinement pass with the tiles of each phase running on all threads,
+// propagation crosses tile borders between phases.
+// Candidate patches are not confined to tiles, so the threads compare
+// patches in the snapshot of the start of the phase and only write their
+// own points. Every tile draws from a generator of its own, which makes
+// the result independent of the number of threads
+bool synthesizer::refine_pass_parallel(const refine_schedule& schedule, bool backward,
+                                       refine_counters& counters)
+{
+    // points filled since the last pass
+    for (int k=0; k<4; ++k)
+        update_snapshot(schedule.phases[k]);
+
+    atomic<bool> converged{true};
+    for (int k=0; k<4; ++k) {
+        const vector<vector<Coordinates>>& phase = schedule.phases[backward ? 3-k : k];
+        int phase_size = phase.size();
+        vector<refine_counters> tile_counters(phase_size);
+        uint64_t phase_seed = draw_seed();
+        pool->parallel_for(phase_size, [&](int i) {
+            const vector<Coordinates>& tile = phase[backward ? phase_size-1-i : i];
+            vector<int> color_diff(input_bytes, 0);
+            random_generator random(phase_seed, i);
+            int tile_size = tile.size();
+            for (int j=0; j<tile_size; ++j) {
+                if (!(j % deadline_check_interval) && past_deadline())
+                    break;
+                const Coordinates& position = tile[backward ? tile_size-1-j : j];
+                if (!active(position))
+                    continue;
+                ++tile_counters[i].active;
+                if (refine_point(position, color_diff, tile_counters[i], random, true))
+                    converged = false;
+            }
+        });
+        update_snapshot(phase);
+        for (int i=0; i<phase_size; ++i)
+            counters += tile_counters[i];
+    }
+    return converged;
+}
+
+// run one refinement pass and add it to its pass statistics
+bool synthesizer::run_refine_pass(const vector<Coordinates>& points, const refine_schedule& schedule,
+        bool backward, bool first, pass_stats& stats)
+{
+    // the first pass over points refines all of them, the following ones
+    // those near changes made since the start of the previous pass,
+    // the changes of the pass before that are dropped
+    ++pass_stamp;
+    all_active = first;
+    if (!first)
+        clear_changes(points, point_changed << (pass_stamp & 1));
+
+    refine_counters counters;
+    bool converged;
+    if (parameters.parallel_refinement)
+        converged = refine_pass_parallel(schedule, backward, counters);
+    else
+        converged = refine_pass(points, backward, counters);
+
+    search_counters += counters.comparisons;
+    ++stats.runs;
+    stats.points += points.size();
+    stats.active_points += counters.active;
+    stats.coherence_improvements += counters.coherence_improvements;
+    stats.random_improvements    += counters.random_improvements;
+    if (converged)
+        ++stats.unchanged_runs;
+    return converged;
+}
+
+Rectangle corpus_region(const Parameters& parameters, int width, int height,
+        int corpus_width, int corpus_height, const Rectangle& selection)
+{
+    int radius = parameters.comp_size;
+    Rectangle corpus(selection);
+
+    /* little geometry so that corpus.x1 and corpus.y1 are now corpus_offset */
+
+    if (corpus.x2 >= width - radius)
+        corpus.x2 = width - radius - 1;
+
+    if (corpus.y2 >= height - radius)
+        corpus.y2 = height - radius - 1;
+
+    corpus.x1 -= (corpus_width  - (corpus.x2-corpus.x1))/2;
+    corpus.x1 = max(radius, corpus.x1);
+    corpus.y1 -= (corpus_height - (corpus.y2-corpus.y1))/2;
+    corpus.y1 = max(radius, corpus.y1);
+
+    corpus.x2 = min(corpus.x1 + corpus_width, width - radius - 1);
+    corpus.y2 = min(corpus.y1 + corpus_height, height - radius - 1);
+
+    return corpus;
+}
+
+Rectangle reference_bounds(const Bitmap<uint8_t>& ref_layer)
+{
+    Rectangle bounds(ref_layer.width, ref_layer.height, 0, 0);
+    for (int y=0; y<ref_layer.height; ++y)
+        for (int x=0; x<ref_layer.width; ++x)
+            if (is_reference_point(ref_layer, x, y)) {
+                bounds.x1 = min(bounds.x1, x);
+                bounds.y1 = min(bounds.y1, y);
+                bounds.x2 = max(bounds.x2, x + 1);
+                bounds.y2 = max(bounds.y2, y + 1);
+            }
+    return bounds;
+}
+
+Rectangle synthesis_region(const Parameters& parameters, int width, int height,
+        const Rectangle& selection, const Rectangle& sources)
+{
+    // one more on every side keeps corpus_region() stable inside the crop
+    int margin = parameters.comp_size + 1;
+    Rectangle region(selection);
+    if (sources.x1 < sources.x2 && sources.y1 < sources.y2) {
+        region.x1 = min(region.x1, sources.x1);
+        region.y1 = min(region.y1, sources.y1);
+        region.x2 = max(region.x2, sources.x2);
+        region.y2 = max(region.y2, sources.y2);
+    }
+    region.x1 = max(0, region.x1 - margin);
+    region.y1 = max(0, region.y1 - margin);
+    region.x2 = min(width,  region.x2 + margin);
+    region.y2 = min(height, region.y2 + margin);
+    return region;
+}
+
+void synthesizer::report_progress(float fraction)
+{
+    if (progress)
+        progress(progress_begin + fraction*progress_span);
+}
+
+// start from the sources of the next coarser level, points whose
+// scaled up source isn't usable are left for the frontier search
+void synthesizer::upsample_sources(const StateMap& coarse_states,
+        const vector<Coordinates>& data_points)
+{
+    vector<int> no_color_diff(input_bytes, 0);
+    vector<Coordinates> upsampled;
+
+    for (size_t i=0; i<data_points.size(); ++i) {
+        const Coordinates& position = data_points[i];
+        Coordinates coarse_position(min(position.x/2, coarse_states.width - 1),
+                                    min(position.y/2, coarse_states.height - 1));
+        const PointState& coarse_state = *coarse_states.at(coarse_position);
+        Coordinates coarse_source = coarse_state.source();
+        Coordinates source(2*coarse_source.x + position.x%2,
+                           2*coarse_source.y + position.y%2);
+        if (coarse_state.has_source() &&
+            clip(data, source) && !states.at(source)->selected())
+        {
+            transfer_patch(data, input_bytes,
+                    states, transfer_belief, defined,
+                    position, source, 0, no_color_diff);
+            upsampled.push_back(position);
+        }
+    }
+
+    score_sources(upsampled);
+}
+
+// start from the sources of an earlier run where they are still usable,
+// the other points are left for the frontier search.
+// Every point takes the best of the sources of the field around it within
+// seed_spatial_radius, compared against the known points of the image only,
+// so the choice can run in parallel
+void synthesizer::seed_sources(const source_field& field,
+        const vector<Coordinates>& data_points)
+{
+    vector<Coordinates> choices(data_points.size());
+    vector<difference_counters> choice_counters(data_points.size());
+    pool->parallel_for(data_points.size(), [&](int i) {
+        const Coordinates& position = data_points[i];
+        int best = INT_MAX;
+        vector<int> color_diff(input_bytes, 0);
+        // points without known neighbours can't compare the sources,
+        // they keep their own or else the first usable one
+        Coordinates fallback;
+        for (int oy=-seed_spatial_radius; oy<=seed_spatial_radius; ++oy)
+            for (int ox=-seed_spatial_radius; ox<=seed_spatial_radius; ++ox) {
+                Coordinates offset(ox, oy);
+                Coordinates near = position + offset;
+                if (!field.covers(near))
+                    continue;
+                const Coordinates& near_source = field.at(near);
+                Coordinates source = near_source - offset;
+                if ((near_source.x || near_source.y) &&
+                    clip(data, source) && !states.at(source)->selected())
+                {
+                    if ((!fallback.x && !fallback.y) || (!ox && !oy))
+                        fallback = source;
+                    try_point(source, position, best, choices[i], color_diff,
+                            choice_counters[i]);
+                }
+            }
+        if (best == INT_MAX)
+            choices[i] = fallback;
+    });
+
+    vector<int> no_color_diff(input_bytes, 0);
+    vector<Coordinates> seeded;
+    for (size_t i=0; i<data_points.size(); ++i) {
+        search_counters += choice_counters[i];
+        const Coordinates& source = choices[i];
+        if (!source.x && !source.y)
+            continue;
+        transfer_patch(data, input_bytes,
+                states, transfer_belief, defined,
+                data_points[i], source, 0, no_color_diff);
+        seeded.push_back(data_points[i]);
+    }
+
+    score_sources(seeded);
+    run_stats.seeded_points += seeded.size();
+}
+
+// beliefs of points given a source by upsample_sources() or seed_sources(),
+// they are scored once the whole initial guess is in place
+void synthesizer::score_sources(const vector<Coordinates>& seeded)
+{
+    pool->parallel_for(seeded.size(), [&](int i) {
+        difference_counters counters;
+        const Coordinates& position = seeded[i];
+        Coordinates source = states.at(position)->source();
+        *transfer_belief.at(position) = kernels.difference(data,
+            defined, comp_patch_radius, source, position, INT_MAX, counters);
+    });
+}
+
+// drop points covered by the block of a more complex point from the
+// batch, they are filled together with it. Dropped points go to skipped.
+// claimed is a scratch map of the data size, it is left cleared
+void synthesizer::drop_covered_points(vector<Coordinates>& points, vector<Coordinates>& skipped,
+        Bitmap<uint8_t>& claimed)
+{
+    vector<Coordinates> kept, claims;
+    skipped.clear();
+    // points come least complex first
+    for (int i=points.size()-1; i>=0; --i) {
+        const Coordinates& position = points[i];
+        if (*claimed.at(position)) {
+            skipped.push_back(position);
+            continue;
+        }
+        kept.push_back(position);
+        for (int oy=block_begin(); oy<block_end(); ++oy)
+            for (int ox=block_begin(); ox<block_end(); ++ox) {
+                Coordinates point = position + Coordinates(ox, oy);
+                if (clip(data, point) && !*claimed.at(point)) {
+                    *claimed.at(point) = 1;
+                    claims.push_back(point);
+                }
+            }
+    }
+    for (size_t i=0; i<claims.size(); ++i)
+        *claimed.at(claims[i]) = 0;
+    points.assign(kept.rbegin(), kept.rend());
+}
+
+// fill the unfilled points of the block around position from the same
+// offsets around source, every point gets its own belief.
+// Filled points are appended to filled
+void synthesizer::transfer_block(const Coordinates& position, const Coordinates& source,
+        vector<Coordinates>& filled, difference_counters& counters)
+{
+    for (int oy=block_begin(); oy<block_end(); ++oy)
+        for (int ox=block_begin(); ox<block_end(); ++ox) {
+            Coordinates offset(ox, oy);
+            Coordinates point = position + offset;
+            Coordinates point_source = source + offset;
+            if ((ox || oy) &&
+                clip(data, point) && states.at(point)->selected() &&
+                !states.at(point)->held() && !defined.get(point) &&
+                clip(data, point_source) && !states.at(point_source)->selected())
+            {
+                int belief = INT_MAX;
+                Coordinates belief_point;
+                vector<int> color_diff(input_bytes, 0);
+                try_point(point_source, point, belief, belief_point, color_diff, counters);
+                transfer_patch(data, input_bytes,
+                        states, transfer_belief, defined,
+                        point, point_source, belief, color_diff);
+                filled.push_back(point);
+            }
+        }
+}
+
+// synthesize the pyramid level which is currently in data and data_mask,
+// coarse_states is the result of the next coarser level or NULL
+void synthesizer::synthesize_level(int level, const Bitmap<uint8_t>* ref_layer,
+        const StateMap* coarse_states)
+{
+    double level_start = clock_seconds();
+
+    states.resize(data.width,data.height);
+    transfer_belief.resize(data.width,data.height);
+    defined.resize(data.width,data.height);
+    pass_stamp = 0;
+
+    // scratch of serial refinement, which runs even when seeded or upsampled
+    // sources leave nothing for the fill loop
+    best_color_diff.assign(input_bytes, 0);
+
+    vector<Coordinates> data_points(0);
+
+    for(int y=0;y<data.height;y++)
+        for(int x=0;x<data.width;x++) {
+            if (!data_mask.at(x,y)[0]) {
+                // ground truth
+                states.at(x,y)->confidence = 255;
+                *transfer_belief.at(x,y) = 0;
+                defined.set(Coordinates(x,y));
+            } else if (component_job && data_mask.at(x,y)[0] == held_mask_value) {
+                // point of another component, neither filled nor a source
+                states.at(x,y)->flags = point_selected | point_held;
+                *transfer_belief.at(x,y) = -1;
+            } else {
+                // point to fill
+                states.at(x,y)->flags = point_selected;
+                *transfer_belief.at(x,y) = -1;
+                data_points.push_back(Coordinates(x,y));
+            }
+        }
+
+    ref_points.clear();
+    if (use_ref_layer) {
+        int ref_width  = min(ref_layer->width,  data.width);
+        int ref_height = min(ref_layer->height, data.height);
+        for(int y=0;y<ref_height;y++)
+            for(int x=0;x<ref_width;x++)
+                if (is_reference_point(*ref_layer, x, y) &&
+                    !data_mask.at(x,y)[0])
+                {
+                    ref_points.push_back(Coordinates(x,y));
+                }
+    }
+
+    run_stats.pyramid_seconds -= clock_seconds();
+
+    source_index = patch_index();
+    if (ann_candidates) {
+        if (use_ref_layer) {
+            source_index.build(data, data_mask, input_bytes, comp_patch_radius, ref_points);
+        } else {
+            vector<Coordinates> corpus_points;
+            for (int y=sel_y1; y<sel_y2; ++y)
+                for (int x=sel_x1; x<sel_x2; ++x)
+                    if (!data_mask.at(x,y)[0])
+                        corpus_points.push_back(Coordinates(x,y));
+            source_index.build(data, data_mask, input_bytes, comp_patch_radius, corpus_points);
+        }
+    }
+
+    int total_points = data_points.size();
+
+    if (coarse_states)
+        upsample_sources(*coarse_states, data_points);
+    else if (initial_field)
+        seed_sources(*initial_field, data_points);
+
+    run_stats.pyramid_seconds += clock_seconds();
+
+    // later changes reach the snapshot through the refinement schedules
+    refine_schedule final_schedule;
+    if (parameters.parallel_refinement) {
+        build_refine_schedule(data_points, final_schedule);
+        take_snapshot();
+    }
+
+    vector<pass_stats> fill_passes(in_loop_pass_count), final_passes(refine_pass_count);
+    for (int p=0; p<in_loop_pass_count; ++p) {
+        pass_stats stats = {level, false, p, 0, 0, 0, 0, 0, 0};
+        fill_passes[p] = stats;
+    }
+    for (int p=0; p<refine_pass_count; ++p) {
+        pass_stats stats = {level, true, p, 0, 0, 0, 0, 0, 0};
+        final_passes[p] = stats;
+    }
+
+    // points that are near already filled points,
+    // that ensures inward propagation
+    edge_frontier frontier;
+    frontier.reset(data, states, defined, data_points,
+            comp_patch_radius, input_bytes);
+
+    UNUFO_LOG("status  dimensions: (%d, %d)\n", states.width, states.height)
+    UNUFO_LOG("data dimensions: (%d, %d)\n", data.width, data.height)
+    UNUFO_LOG("ref_layer dimensions: (%d, %d, %d, %d)\n", sel_x1, sel_y1, sel_x2-sel_x1, sel_y2-sel_y1)
+    UNUFO_LOG("total points to be filled: %d\n", total_points)
+
+    int points_to_go = 0;
+    for (size_t i=0; i<data_points.size(); ++i)
+        if (!defined.get(data_points[i]))
+            ++points_to_go;
+
+    // scratch map for drop_covered_points
+    Bitmap<uint8_t> claimed;
+    if (transfer_size > 1)
+        claimed.resize(data.width, data.height, 1);
+
+    vector<Coordinates> edge_positions, skipped_positions, filled_positions;
+    while (points_to_go > 0) {
+        report_progress(
+            float(in_loop_pass_count)/(in_loop_pass_count + refine_pass_count)*
+            (1.0-float(points_to_go)/(total_points)));
+
+        fill_stats iteration = {level, int(frontier.size()), 0, 0, 0, false};
+
+        run_stats.frontier_seconds -= clock_seconds();
+
+        frontier.take(edge_positions);
+        if (transfer_size > 1)
+            drop_covered_points(edge_positions, skipped_positions, claimed);
+        size_t edge_points_size = edge_positions.size();
+        iteration.searched = edge_points_size;
+
+        run_stats.frontier_seconds += clock_seconds();
+        run_stats.search_seconds -= clock_seconds();
+
+        // find best-fit patches for edge_positions,
+        // the search only reads shared state so it runs on all threads
+        vector<Coordinates> candidates(edge_points_size);
+        vector<difference_counters> candidate_counters(edge_points_size);
+        uint64_t search_seed = draw_seed();
+        pool->parallel_for(edge_points_size, [&](int i) {
+            random_generator random(search_seed, i);
+            candidates[i] = search(parameters.tries, edge_positions[i], candidate_counters[i], random);
+        });
+        for(size_t i=0; i < edge_points_size; ++i)
+            search_counters += candidate_counters[i];
+
+        run_stats.search_seconds += clock_seconds();
+
+        // commit found patches in edge_positions order,
+        // with blocks a point may already be filled by an earlier block
+        filled_positions.clear();
+        for(size_t i=0; i < edge_points_size; ++i) {
+            Coordinates position = edge_positions[i];
+            if (defined.get(position))
+                continue;
+
+            best = INT_MAX;
+            best_color_diff.assign(input_bytes, 0);
+
+            try_point(candidates[i], position, best, best_point, best_color_diff, search_counters);
+
+            transfer_patch(data, input_bytes,
+                    states, transfer_belief, defined,
+                    position, best_point, best, best_color_diff);
+            filled_positions.push_back(position);
+
+            if (transfer_size > 1)
+                transfer_block(position, best_point, filled_positions, search_counters);
+        }
+        iteration.filled = filled_positions.size();
+
+        run_stats.refinement_seconds -= clock_seconds();
+
+        refine_schedule edge_schedule;
+        if (parameters.parallel_refinement)
+            build_refine_schedule(filled_positions, edge_schedule);
+
+        // once the time budget is spent the rest of the selection
+        // is filled without refinement, a complete fill comes first
+        for (int p=0; p<(past_deadline() ? 0 : in_loop_pass_count); ++p) {
+            ++iteration.refine_passes;
+            if (run_refine_pass(filled_positions, edge_schedule, p%2, !p, fill_passes[p])) {
+                ++run_stats.converge_count;
+                iteration.converged = true;
+                break;
+            }
+        }
+        // the next passes start over on other points
+        clear_changes(filled_positions, point_changed | point_changed << 1);
+
+        run_stats.refinement_seconds += clock_seconds();
+        run_stats.iterations.push_back(iteration);
+
+        if (!edge_points_size)
+            break;
+        points_to_go -= filled_positions.size();
+
+        // only the neighbourhoods of the points just filled and refined changed,
+        // skipped points left unfilled go back to the frontier from there too
+        run_stats.frontier_seconds -= clock_seconds();
+
+        for(size_t i=0; i < filled_positions.size(); ++i)
+            frontier.touch(filled_positions[i]);
+        for(size_t i=0; i < skipped_positions.size(); ++i)
+            frontier.touch(skipped_positions[i]);
+        frontier.update(data, states, defined);
+
+        run_stats.frontier_seconds += clock_seconds();
+    }
+
+    run_stats.final_refinement_seconds -= clock_seconds();
+
+    // with a time budget the final level is refined for as long as there
+    // is time and anything changes, results only ever improve, so the
+    // state at the deadline is the best one found
+    int final_pass_count = deadline && !level ? INT_MAX : refine_pass_count;
+    for (int p=0; p<final_pass_count; ++p) {
+        if (past_deadline())
+            break;
+        if (p == int(final_passes.size())) {
+            pass_stats stats = {level, true, p, 0, 0, 0, 0, 0, 0};
+            final_passes.push_back(stats);
+        }
+        report_progress(float(in_loop_pass_count + min(p, refine_pass_count - 1))/
+                (in_loop_pass_count + refine_pass_count));
+        if (run_refine_pass(data_points, final_schedule, p%2, !p, final_passes[p]))
+            break;
+    }
+    if (past_deadline())
+        run_stats.deadline_hit = true;
+
+    run_stats.final_refinement_seconds += clock_seconds();
+
+    run_stats.passes.insert(run_stats.passes.end(), fill_passes.begin(), fill_passes.end());
+    run_stats.passes.insert(run_stats.passes.end(), final_passes.begin(), final_passes.end());
+    level_stats stats = {level, data.width, data.height, total_points, points_to_go,
+                         clock_seconds() - level_start};
+    run_stats.levels.push_back(stats);
+
+    UNUFO_LOG("\n%d points left unfilled\n", points_to_go)
+}
+
+void synthesizer::configure(const Parameters& new_parameters, int bpp, progress_callback progress_fn)
+{
+    parameters = new_parameters;
+
+    comp_patch_radius = parameters.comp_size;
+
+    equal_adjustment = parameters.equal_adjustment;
+    max_adjustment   = parameters.max_adjustment;
+
+    ann_candidates = parameters.ann_candidates;
+
+    transfer_size = max(1, parameters.transfer_size);
+
+    input_bytes = bpp;
+    kernels = select_patch_kernels(comp_patch_radius, input_bytes);
+
+    progress = progress_fn;
+
+    // a shared pool is left as it is
+    if (pool && !own_pool)
+        return;
+    if (!own_pool || (parameters.threads > 0 && own_pool->size() != parameters.threads))
+        own_pool.reset(new thread_pool(parameters.threads));
+    pool = own_pool.get();
+}
+
+// corpus on pyramid level of a width x height image, kept a patch radius
+// away from the borders, the global search takes its candidates from it
+Rectangle synthesizer::level_corpus(const Rectangle& corpus, int level,
+        int width, int height) const
+{
+    return Rectangle(max(comp_patch_radius, corpus.x1 >> level),
+            max(comp_patch_radius, corpus.y1 >> level),
+            min(corpus.x2 >> level, width  - comp_patch_radius - 1),
+            min(corpus.y2 >> level, height - comp_patch_radius - 1));
+}
+
+// whether the global search has points to take patches from: unmasked
+// reference points, or without a reference layer unmasked points of level_corpus
+bool synthesizer::has_sources(const Bitmap<uint8_t>& mask, const Bitmap<uint8_t>* ref_layer,
+        const Rectangle& level_corpus) const
+{
+    if (use_ref_layer) {
+        int ref_width  = min(ref_layer->width,  mask.width);
+        int ref_height = min(ref_layer->height, mask.height);
+        for (int y=0; y<ref_height; ++y)
+            for (int x=0; x<ref_width; ++x)
+                if (is_reference_point(*ref_layer, x, y) && !mask.at(x, y)[0])
+                    return true;
+        return false;
+    }
+    for (int y=level_corpus.y1; y<level_corpus.y2; ++y)
+        for (int x=level_corpus.x1; x<level_corpus.x2; ++x)
+            if (!mask.at(x, y)[0])
+                return true;
+    return false;
+}
+
+// synthesize image as a whole, on all pyramid levels.
+// Returns false without touching image if there are no points to take
+// patches from, the image is too small for the patch size or fully masked
+bool synthesizer::fill(Bitmap<uint8_t>& image, Bitmap<uint8_t>& image_mask,
+        const Bitmap<uint8_t>* ref_layer,
+        const Rectangle& selection, const Rectangle& corpus)
+{
+    if (!has_sources(image_mask, ref_layer,
+            level_corpus(corpus, 0, image.width, image.height)))
+    {
+        UNUFO_LOG("no source points in the corpus\n")
+        return false;
+    }
+
+    // work on the caller's buffers in place, they are handed back below
+    data.swap(image);
+    data_mask.swap(image_mask);
+
+    // coarser levels as long as the selection stays larger than a patch,
+    // an initial field takes their place
+    int levels = 1;
+    int selection_size = max(selection.width(), selection.height());
+    int patch_size = 2*comp_patch_radius + 1;
+    while (!initial_field && levels < parameters.pyramid_levels &&
+           selection_size >> levels >= 2*patch_size &&
+           min(data.width, data.height) >> levels >= 4*patch_size)
+        ++levels;
+
+    run_stats.pyramid_seconds -= clock_seconds();
+
+    // level 0 stays in data, data_mask and *ref_layer
+    vector<unique_ptr<Bitmap<uint8_t>>> images(levels), masks(levels), ref_layers(levels);
+    for (int l=1; l<levels; ++l) {
+        const Bitmap<uint8_t>& finer_image = l > 1 ? *images[l-1] : data;
+        const Bitmap<uint8_t>& finer_mask  = l > 1 ? *masks[l-1]  : data_mask;
+        images[l].reset(new Bitmap<uint8_t>());
+        masks[l].reset(new Bitmap<uint8_t>());
+        downsample(finer_image, finer_mask, *images[l], *masks[l]);
+        if (use_ref_layer) {
+            ref_layers[l].reset(new Bitmap<uint8_t>());
+            downsample_reference(l > 1 ? *ref_layers[l-1] : *ref_layer, *ref_layers[l]);
+        }
+        // masked points spread when downsampling, the coarser levels
+        // start where no sources are left
+        if (!has_sources(*masks[l], ref_layers[l].get(),
+                level_corpus(corpus, l, images[l]->width, images[l]->height)))
+        {
+            levels = l;
+            break;
+        }
+    }
+
+    run_stats.pyramid_seconds += clock_seconds();
+
+    // progress is split between levels by their size
+    float total_weight = 0;
+    for (int l=0; l<levels; ++l)
+        total_weight += 1.0/(1 << 2*l);
+    progress_begin = 0;
+
+    StateMap coarse_states;
+    for (int l=levels-1; l>=0; --l) {
+        UNUFO_LOG("pyramid level %d of %d\n", l, levels)
+        progress_span = 1.0/(1 << 2*l)/total_weight;
+
+        if (l) {
+            data.swap(*images[l]);
+            data_mask.swap(*masks[l]);
+        }
+
+        Rectangle sources = level_corpus(corpus, l, data.width, data.height);
+        sel_x1 = sources.x1;
+        sel_y1 = sources.y1;
+        sel_x2 = sources.x2;
+        sel_y2 = sources.y2;
+
+        synthesize_level(l, l ? ref_layers[l].get() : ref_layer,
+                l < levels-1 ? &coarse_states : NULL);
+
+        if (l) {
+            states.swap(coarse_states);
+            data.swap(*images[l]);
+            data_mask.swap(*masks[l]);
+        }
+        progress_begin += progress_span;
+    }
+
+    // match of the result, filled points of level 0 only
+    for (int y=0; y<data.height; ++y)
+        for (int x=0; x<data.width; ++x) {
+            const PointState* state = states.at(x, y);
+            if (state->selected() && !state->held() && *transfer_belief.at(x, y) > 0)
+                run_stats.total_belief += *transfer_belief.at(x, y);
+        }
+
+    result_field.reset(selection);
+    for (int y=selection.y1; y<selection.y2; ++y)
+        for (int x=selection.x1; x<selection.x2; ++x) {
+            const PointState* state = states.at(x, y);
+            if (state->selected() && !state->held())
+                result_field.at(Coordinates(x, y)) = state->source();
+        }
+
+    data.swap(image);
+    data_mask.swap(image_mask);
+    return true;
+}
+
+// label the points nonzero in mask by connected component, points are
+// connected if the patches of radius around them overlap or touch.
+// box is selection grown by radius, labels holds the component of every
+// point of box, -1 for points not in the mask.
+// bounds and sizes get the bounding box and point count of every component
+static void label_components(const Bitmap<uint8_t>& mask, const Rectangle& selection,
+        int radius, Rectangle& box, Matrix<int>& labels,
+        vector<Rectangle>& bounds, vector<int>& sizes)
+{
+    box = Rectangle(max(0, selection.x1 - radius), max(0, selection.y1 - radius),
+            min(mask.width, selection.x2 + radius), min(mask.height, selection.y2 + radius));
+    int width = box.width(), height = box.height();
+
+    // mask dilated by radius, by counting mask points in a sliding
+    // window along rows, then along columns
+    Matrix<uint8_t> rows, dilated;
+    rows.resize(width, height);
+    dilated.resize(width, height);
+    for (int y=0; y<height; ++y) {
+        int count = 0;
+        for (int x=-radius; x<width; ++x) {
+            if (x + radius < width && mask.at(box.x1 + x + radius, box.y1 + y)[0])
+                ++count;
+            if (x - radius > 0 && mask.at(box.x1 + x - radius - 1, box.y1 + y)[0])
+                --count;
+            if (x >= 0)
+                *rows.at(x, y) = count > 0;
+        }
+    }
+    for (int x=0; x<width; ++x) {
+        int count = 0;
+        for (int y=-radius; y<height; ++y) {
+            if (y + radius < height)
+                count += *rows.at(x, y + radius);
+            if (y - radius > 0)
+                count -= *rows.at(x, y - radius - 1);
+            if (y >= 0)
+                *dilated.at(x, y) = count > 0;
+        }
+    }
+
+    // 8-connected components of the dilated mask, in scan order
+    labels.resize(width, height);
+    for (int i=0; i<width*height; ++i)
+        labels.data[i] = -1;
+    bounds.clear();
+    sizes.clear();
+    vector<Coordinates> stack;
+    for (int y=0; y<height; ++y)
+        for (int x=0; x<width; ++x) {
+            if (!*dilated.at(x, y) || *labels.at(x, y) >= 0)
+                continue;
+            int label = bounds.size();
+            Rectangle component(mask.width, mask.height, 0, 0);
+            int size = 0;
+            *labels.at(x, y) = label;
+            stack.push_back(Coordinates(x, y));
+            while (!stack.empty()) {
+                Coordinates point = stack.back();
+                stack.pop_back();
+                if (mask.at(box.x1 + point.x, box.y1 + point.y)[0]) {
+                    component.x1 = min(component.x1, box.x1 + point.x);
+                    component.y1 = min(component.y1, box.y1 + point.y);
+                    component.x2 = max(component.x2, box.x1 + point.x + 1);
+                    component.y2 = max(component.y2, box.y1 + point.y + 1);
+                    ++size;
+                }
+                for (int oy=-1; oy<=1; ++oy)
+                    for (int ox=-1; ox<=1; ++ox) {
+                        Coordinates next = point + Coordinates(ox, oy);
+                        if (next.x >= 0 && next.y >= 0 && next.x < width && next.y < height &&
+                            *dilated.at(next) && *labels.at(next) < 0)
+                        {
+                            *labels.at(next) = label;
+                            stack.push_back(next);
+                        }
+                    }
+            }
+            bounds.push_back(component);
+            sizes.push_back(size);
+        }
+
+    // only mask points keep their label
+    for (int y=0; y<height; ++y)
+        for (int x=0; x<width; ++x)
+            if (!mask.at(box.x1 + x, box.y1 + y)[0])
+                *labels.at(x, y) = -1;
+}
+
+// fill every connected component of the selection as a job of its own,
+// on the part of the image the component and its corpus cover.
+// Jobs run in parallel, the largest first, and only write the points of
+// their component, so they never see each other's work.
+// Returns false if there is only one component, or if a component has no
+// sources in the corpus, the selection is to be filled as a whole then
+bool synthesizer::run_components(Bitmap<uint8_t>& image, const Bitmap<uint8_t>& image_mask,
+        const Bitmap<uint8_t>* ref_layer,
+        const Rectangle& selection, const Rectangle& corpus)
+{
+    Rectangle box;
+    Matrix<int> labels;
+    vector<Rectangle> bounds;
+    vector<int> sizes;
+    label_components(image_mask, selection, comp_patch_radius, box, labels, bounds, sizes);
+    int components = bounds.size();
+    if (components < 2)
+        return false;
+
+    UNUFO_LOG("selection split into %d components\n", components)
+
+    // the corpus of a component extends as far beyond it as the corpus
+    // extends beyond the selection, but at least a few patches
+    int reach = max(max(selection.x1 - corpus.x1, selection.y1 - corpus.y1),
+                    max(corpus.x2 - selection.x2, corpus.y2 - selection.y2));
+    reach = max(reach, 4*(2*comp_patch_radius + 1));
+    Rectangle ref_bounds;
+    if (use_ref_layer)
+        ref_bounds = reference_bounds(*ref_layer);
+
+    vector<int> order(components);
+    int total_points = 0;
+    for (int k=0; k<components; ++k) {
+        order[k] = k;
+        total_points += sizes[k];
+    }
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return sizes[a] > sizes[b]; });
+
+    vector<synthesis_stats> job_stats(components);
+    uint64_t jobs_seed = draw_seed();
+    atomic<int> points_done{0};
+    atomic<bool> failed{false};
+    thread::id caller = this_thread::get_id();
+    progress_begin = 0;
+    progress_span = 1;
+    result_field.reset(selection);
+
+    // fill component k from the sources within reach of it, or from all
+    // sources if whole_sources is set, false if the job found none
+    auto run_job = [&](int k, bool whole_sources) {
+        const Rectangle& component = bounds[k];
+        Rectangle job_corpus(max(corpus.x1, component.x1 - reach),
+                max(corpus.y1, component.y1 - reach),
+                min(corpus.x2, component.x2 + reach),
+                min(corpus.y2, component.y2 + reach));
+        if (whole_sources || job_corpus.x1 >= job_corpus.x2 || job_corpus.y1 >= job_corpus.y2)
+            job_corpus = corpus;
+        // reference points are taken from the part of the reference
+        // bounds within the corpus of the job
+        Rectangle sources = job_corpus;
+        if (use_ref_layer) {
+            sources = Rectangle(max(ref_bounds.x1, job_corpus.x1), max(ref_bounds.y1, job_corpus.y1),
+                    min(ref_bounds.x2, job_corpus.x2), min(ref_bounds.y2, job_corpus.y2));
+            if (whole_sources || sources.x1 >= sources.x2 || sources.y1 >= sources.y2)
+                sources = ref_bounds;
+        }
+        Rectangle region = synthesis_region(parameters, image.width, image.height,
+                component, sources);
+        Coordinates origin(region.x1, region.y1);
+
+        // points of other components are only marked, other jobs may be
+        // writing their pixels
+        Bitmap<uint8_t> job_image, job_mask, job_ref_layer;
+        job_image.resize(region.width(), region.height(), image.depth);
+        job_mask.resize(region.width(), region.height(), 1);
+        for (int y=region.y1; y<region.y2; ++y)
+            for (int x=region.x1; x<region.x2; ++x) {
+                uint8_t& masked = job_mask.at(x - region.x1, y - region.y1)[0];
+                if (image_mask.at(x, y)[0]) {
+                    bool own = x >= box.x1 && y >= box.y1 && x < box.x2 && y < box.y2 &&
+                        *labels.at(x - box.x1, y - box.y1) == k;
+                    masked = own ? 255 : held_mask_value;
+                    if (!own)
+                        continue;
+                }
+                memcpy(job_image.at(x - region.x1, y - region.y1), image.at(x, y), image.depth);
+            }
+        if (use_ref_layer) {
+            // reference points outside of sources are left out
+            job_ref_layer.resize(region.width(), region.height(), ref_layer->depth);
+            for (int y=max(region.y1, sources.y1); y<min(region.y2, sources.y2); ++y)
+                memcpy(job_ref_layer.at(max(region.x1, sources.x1) - region.x1, y - region.y1),
+                        ref_layer->at(max(region.x1, sources.x1), y),
+                        (min(region.x2, sources.x2) - max(region.x1, sources.x1))*ref_layer->depth);
+        }
+
+        // the part of the initial field over the component
+        source_field job_field;
+        if (initial_field) {
+            job_field.reset(Rectangle(component.x1 - region.x1, component.y1 - region.y1,
+                    component.x2 - region.x1, component.y2 - region.y1));
+            for (int y=component.y1; y<component.y2; ++y)
+                for (int x=component.x1; x<component.x2; ++x) {
+                    Coordinates position(x, y);
+                    if (!initial_field->covers(position))
+                        continue;
+                    const Coordinates& source = initial_field->at(position);
+                    if (source.x || source.y)
+                        job_field.at(position - origin) = source - origin;
+                }
+        }
+
+        synthesizer job(pool);
+        job.configure(parameters, input_bytes, NULL);
+        job.component_job = true;
+        job.rng = random_generator(jobs_seed, k);
+        job.deadline = deadline;
+        if (!job.run(job_image, job_mask, use_ref_layer ? &job_ref_layer : NULL,
+                Rectangle(component.x1 - region.x1, component.y1 - region.y1,
+                        component.x2 - region.x1, component.y2 - region.y1),
+                Rectangle(job_corpus.x1 - region.x1, job_corpus.y1 - region.y1,
+                        job_corpus.x2 - region.x1, job_corpus.y2 - region.y1),
+                initial_field ? &job_field : NULL))
+            return false;
+        job_stats[k] = job.run_stats;
+
+        // components don't overlap, neither do the points jobs write
+        for (int y=region.y1; y<region.y2; ++y)
+            for (int x=region.x1; x<region.x2; ++x) {
+                if (job_mask.at(x - region.x1, y - region.y1)[0] != 255)
+                    continue;
+                memcpy(image.at(x, y), job_image.at(x - region.x1, y - region.y1), image.depth);
+                Coordinates position(x, y);
+                const Coordinates& source = job.result_field.at(position - origin);
+                if (source.x || source.y)
+                    result_field.at(position) = source + origin;
+            }
+        return true;
+    };
+
+    auto run_component = [&](int i) {
+        int k = order[i];
+        if (!run_job(k, false) && !run_job(k, true)) {
+            failed = true;
+            return;
+        }
+
+        // progress callbacks may not expect other threads
+        points_done += sizes[k];
+        if (this_thread::get_id() == caller)
+            report_progress(float(points_done)/total_points);
+    };
+
+    // a component larger than its share of the threads would keep one of
+    // them busy long after the others are done, such components are filled
+    // first, one at a time, their own loops running on the whole pool.
+    // The other jobs share the pool, the loops inside a job running on the
+    // workers run serially on its thread, see thread_pool::parallel_for()
+    int first_shared = 0, shared_points = total_points;
+    while (first_shared < components && !failed &&
+           int64_t(sizes[order[first_shared]])*pool->size() > shared_points)
+    {
+        run_component(first_shared);
+        shared_points -= sizes[order[first_shared]];
+        ++first_shared;
+    }
+    if (!failed)
+        pool->parallel_for(components - first_shared, [&](int i) {
+            run_component(first_shared + i);
+        });
+
+    // the sources of some component are out of the corpus
+    if (failed) {
+        UNUFO_LOG("component without sources, filling the selection as a whole\n")
+        return false;
+    }
+
+    // summed in component order, independent of the schedule
+    for (int k=0; k<components; ++k) {
+        const synthesis_stats& stats = job_stats[k];
+        run_stats.pyramid_seconds  += stats.pyramid_seconds;
+        run_stats.frontier_seconds += stats.frontier_seconds;
+        run_stats.search_seconds   += stats.search_seconds;
+        run_stats.refinement_seconds += stats.refinement_seconds;
+        run_stats.final_refinement_seconds += stats.final_refinement_seconds;
+        run_stats.converge_count += stats.converge_count;
+        run_stats.total_belief   += stats.total_belief;
+        run_stats.seeded_points  += stats.seeded_points;
+        run_stats.deadline_hit    = run_stats.deadline_hit || stats.deadline_hit;
+        search_counters.compared += stats.compared;
+        search_counters.pruned   += stats.pruned;
+        run_stats.levels.insert(run_stats.levels.end(), stats.levels.begin(), stats.levels.end());
+        run_stats.iterations.insert(run_stats.iterations.end(),
+                stats.iterations.begin(), stats.iterations.end());
+        for (size_t i=0; i<stats.passes.size(); ++i) {
+            const pass_stats& pass = stats.passes[i];
+            size_t j = 0;
+            while (j < run_stats.passes.size() && (run_stats.passes[j].level != pass.level ||
+                   run_stats.passes[j].final_pass != pass.final_pass ||
+                   run_stats.passes[j].pass != pass.pass))
+                ++j;
+            if (j == run_stats.passes.size()) {
+                run_stats.passes.push_back(pass);
+                continue;
+            }
+            pass_stats& sum = run_stats.passes[j];
+            sum.runs   += pass.runs;
+            sum.points += pass.points;
+            sum.active_points += pass.active_points;
+            sum.coherence_improvements += pass.coherence_improvements;
+            sum.random_improvements    += pass.random_improvements;
+            sum.unchanged_runs         += pass.unchanged_runs;
+        }
+    }
+    run_stats.components = components;
+
+    return true;
+}
+
+bool synthesizer::run(Bitmap<uint8_t>& image, Bitmap<uint8_t>& image_mask,
+        const Bitmap<uint8_t>* ref_layer,
+        const Rectangle& selection, const Rectangle& corpus,
+        const source_field* initial)
+{
+    run_stats.clear();
+    result_field.reset(Rectangle());
+    initial_field = initial;
+    run_stats.total_seconds -= clock_seconds();
+
+    // jobs get their generator and deadline from the run that split them
+    if (!component_job) {
+        rng = random_generator(parameters.seed ? parameters.seed : time(0));
+        deadline = parameters.time_budget_ms > 0 ?
+            clock_seconds() + parameters.time_budget_ms*1e-3 : 0;
+    }
+
+    use_ref_layer = parameters.use_ref_layer && ref_layer;
+
+    search_counters = difference_counters();
+
+    run_stats.threads = pool->size();
+
+    /* Sanity check */
+
+    bool nothing_to_fill = true;
+    for (int y=selection.y1; nothing_to_fill && y<selection.y2; ++y)
+        for (int x=selection.x1; x<selection.x2; ++x)
+            if (image_mask.at(x,y)[0]) {
+                nothing_to_fill = false;
+                break;
+            }
+    if (nothing_to_fill)
+        return false;
+
+    // sources are stored in 16 bits
+    if (image.width > max_state_map_side || image.height > max_state_map_side) {
+        UNUFO_LOG("image too large: (%d, %d)\n", image.width, image.height)
+        return false;
+    }
+
+    if (!parameters.split_components || component_job ||
+        !run_components(image, image_mask, ref_layer, selection, corpus))
+    {
+        run_stats.components = 1;
+        if (!fill(image, image_mask, ref_layer, selection, corpus)) {
+            initial_field = NULL;
+            return false;
+        }
+    }
+    initial_field = NULL;
+
+    run_stats.total_seconds += clock_seconds();
+    run_stats.compared = search_counters.compared;
+    run_stats.pruned   = search_counters.pruned;
+
+    struct rusage usage;
+    if (!getrusage(RUSAGE_SELF, &usage))
+        run_stats.peak_memory_kb = usage.ru_maxrss;
+
+    UNUFO_LOG("populating edge_points took %.0f usec\n", run_stats.frontier_seconds*1e6)
+    UNUFO_LOG("random search took %.0f usec\n", run_stats.search_seconds*1e6)
+    UNUFO_LOG("refinement took %.0f usec\n", run_stats.refinement_seconds*1e6)
+    UNUFO_LOG("early converge count: %d\n", run_stats.converge_count)
+    UNUFO_LOG("patch comparisons: %llu, pruned early: %llu\n",
+        (unsigned long long)search_counters.compared,
+        (unsigned long long)search_counters.pruned)
+    UNUFO_LOG("overall time: %.0f usec\n", run_stats.total_seconds*1e6)
+
+    return true;
+}
+
+synthesis_context::synthesis_context(thread_pool* pool):
+    synthesizer_(new synthesizer(pool)), configured_(false)
+{
+}
+
+synthesis_context::~synthesis_context()
+{
+}
+
+void synthesis_context::configure(const Parameters& parameters, int bpp,
+        progress_callback progress)
+{
+    synthesizer_->configure(parameters, bpp, progress);
+    configured_ = true;
+}
+
+bool synthesis_context::run(Bitmap<uint8_t>& image, Bitmap<uint8_t>& image_mask,
+        const Bitmap<uint8_t>* ref_layer,
+        const Rectangle& selection, const Rectangle& corpus,
+        const source_field* initial)
+{
+    if (!configured_) {
+        UNUFO_LOG("synthesis context run before configure\n")
+        return false;
+    }
+    return synthesizer_->run(image, image_mask, ref_layer, selection, corpus, initial);
+}
+
+const synthesis_stats& synthesis_context::stats() const
+{
+    return synthesizer_->run_stats;
+}
+
+const source_field& synthesis_context::field() const
+{
+    return synthesizer_->result_field;
+}
+
+bool synthesize(const Parameters& parameters, int bpp,
+        Bitmap<uint8_t>& image, Bitmap<uint8_t>& image_mask,
+        const Bitmap<uint8_t>* ref_layer,
+        const Rectangle& selection, const Rectangle& corpus,
+        progress_callback progress, synthesis_stats* stats)
+{
+    synthesis_context context;
+    context.configure(parameters, bpp, progress);
+    if (!context.run(image, image_mask, ref_layer, selection, corpus, NULL))
+        return false;
+    if (stats)
+        *stats = context.stats();
+    return true;
+}
+
+}
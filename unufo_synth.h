@@ -0,0 +1,143 @@
+#ifndef UNUFO_SYNTH_H
+#define UNUFO_SYNTH_H
+
+#include <memory>
+#include <vector>
+
+#include "unufo_stats.h"
+#include "unufo_types.h"
+
+namespace unufo {
+
+/// receives overall progress in range [0, 1]
+typedef void (*progress_callback)(float fraction);
+
+/// region random candidates are taken from when no reference layer is used,
+/// corpus_width x corpus_height centered on the selection and kept a patch
+/// radius away from the borders of a width x height image
+Rectangle corpus_region(const Parameters& parameters, int width, int height,
+        int corpus_width, int corpus_height, const Rectangle& selection);
+
+/// bounding box of the points marked in a reference layer
+Rectangle reference_bounds(const Bitmap<uint8_t>& ref_layer);
+
+/// the part of a width x height image synthesize() reads and writes:
+/// the selection and the sources (corpus region or reference bounds)
+/// grown by the patch radius.
+/// Callers only need to fetch, pass and write back this region,
+/// with all rectangles translated to its origin.
+Rectangle synthesis_region(const Parameters& parameters, int width, int height,
+        const Rectangle& selection, const Rectangle& sources);
+
+/// source of every point of a rectangle of an image, the nearest
+/// neighbour field a run found for its selection, which a later run
+/// over the same image can start from
+struct source_field
+{
+    /// the covered part of the image, in its coordinates like the sources
+    Rectangle bounds;
+    /// row by row over bounds, (0, 0) for points without a source
+    std::vector<Coordinates> sources;
+
+    /// cover new_bounds, all points without a source
+    void reset(const Rectangle& new_bounds) {
+        bounds = new_bounds;
+        sources.assign(std::max(0, bounds.width()*bounds.height()), Coordinates());
+    }
+
+    bool covers(const Coordinates& position) const {
+        return position.x >= bounds.x1 && position.y >= bounds.y1 &&
+               position.x < bounds.x2 && position.y < bounds.y2;
+    }
+
+    Coordinates& at(const Coordinates& position) {
+        return sources[(position.y - bounds.y1)*bounds.width() + position.x - bounds.x1];
+    }
+
+    const Coordinates& at(const Coordinates& position) const {
+        return sources[(position.y - bounds.y1)*bounds.width() + position.x - bounds.x1];
+    }
+
+    /// move the field and its sources by (dx, dy), like content moving
+    /// from one frame to the next or into a crop of the image
+    void translate(int dx, int dy) {
+        bounds = Rectangle(bounds.x1 + dx, bounds.y1 + dy, bounds.x2 + dx, bounds.y2 + dy);
+        for (size_t i=0; i<sources.size(); ++i)
+            if (sources[i].x || sources[i].y)
+                sources[i] = sources[i] + Coordinates(dx, dy);
+    }
+};
+
+class synthesizer;
+class thread_pool;
+
+/// everything one synthesis works on, so that independent heals can run
+/// at the same time in one process.
+///
+/// Create a context, configure() it and run() it on an image, the result
+/// is filled into the image, stats() fetches the statistics of the run.
+/// A context may be configured and run again, reusing its buffers.
+/// One context runs one synthesis at a time, different contexts may run
+/// concurrently on different threads.
+class synthesis_context
+{
+public:
+    /// the parallel loops of the context run on pool, which may be shared
+    /// by contexts running concurrently and must outlive them.
+    /// The loops of such contexts queue for the workers of the pool,
+    /// each context working on its own loop meanwhile.
+    /// NULL gives the context a pool of its own, parameters.threads large
+    explicit synthesis_context(thread_pool* pool = NULL);
+    ~synthesis_context();
+
+    /// parameters and progress are used by the following runs,
+    /// bpp is the channel count of their images, progress may be NULL
+    void configure(const Parameters& parameters, int bpp,
+            progress_callback progress = NULL);
+
+    /// fill the points of image which are nonzero in image_mask
+    ///
+    /// selection is the bounding box of the selection, corpus is the result of
+    /// corpus_region() for the same image.
+    /// ref_layer marks source points and is only used if parameters.use_ref_layer
+    /// is set, it must have the same dimensions as image then.
+    ///
+    /// initial may hold the field() of an earlier run over the same image,
+    /// the points whose source in it is still usable start from it and are
+    /// only refined, the pyramid is skipped then.
+    ///
+    /// image and image_mask are borrowed for the duration of the call.
+    /// Returns false if the context isn't configured, there is nothing
+    /// to fill, image is wider or higher than max_state_map_side, or
+    /// there are no unmasked points in the corpus (reference points with
+    /// a reference layer) to take patches from.
+    bool run(Bitmap<uint8_t>& image, Bitmap<uint8_t>& image_mask,
+            const Bitmap<uint8_t>* ref_layer,
+            const Rectangle& selection, const Rectangle& corpus,
+            const source_field* initial = NULL);
+
+    /// statistics of the last run
+    const synthesis_stats& stats() const;
+
+    /// sources the last run found for the points of its selection
+    const source_field& field() const;
+
+private:
+    std::unique_ptr<synthesizer> synthesizer_;
+    bool configured_;
+
+    synthesis_context(const synthesis_context&);
+    synthesis_context& operator=(const synthesis_context&);
+};
+
+/// run a synthesis on a context of its own, see synthesis_context::run().
+/// Statistics of the run are stored into stats unless it is NULL
+bool synthesize(const Parameters& parameters, int bpp,
+        Bitmap<uint8_t>& image, Bitmap<uint8_t>& image_mask,
+        const Bitmap<uint8_t>* ref_layer,
+        const Rectangle& selection, const Rectangle& corpus,
+        progress_callback progress, synthesis_stats* stats);
+
+}
+
+#endif // UNUFO_SYNTH_H
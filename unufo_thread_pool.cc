@@ -0,0 +1,114 @@
+#include "unufo_thread_pool.h"
+
+#include <algorithm>
+
+namespace unufo {
+
+// the pools whose loop tasks the thread is running, innermost first.
+// Loops started from those tasks on one of these pools run serially on
+// their thread, loops on other pools are queued as usual
+struct pooled_loop_frame
+{
+    const thread_pool* pool;
+    const pooled_loop_frame* outer;
+};
+
+static thread_local const pooled_loop_frame* pooled_loops = NULL;
+
+static bool in_loop_of(const thread_pool* pool)
+{
+    for (const pooled_loop_frame* f = pooled_loops; f; f = f->outer)
+        if (f->pool == pool)
+            return true;
+    return false;
+}
+
+thread_pool::thread_pool(int thread_count):
+    stop_{false}
+{
+    if (thread_count <= 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i=1; i<thread_count; ++i)
+        workers_.push_back(std::thread(&thread_pool::worker_loop, this));
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    work_ready_.notify_all();
+    for (size_t i=0; i<workers_.size(); ++i)
+        workers_[i].join();
+}
+
+void thread_pool::run_tasks(loop& l)
+{
+    pooled_loop_frame frame = {this, pooled_loops};
+    pooled_loops = &frame;
+    int i;
+    while ((i = l.next++) < l.count)
+        (*l.task)(i);
+    pooled_loops = frame.outer;
+}
+
+void thread_pool::dequeue(loop& l)
+{
+    std::deque<loop*>::iterator it = std::find(loops_.begin(), loops_.end(), &l);
+    if (it != loops_.end())
+        loops_.erase(it);
+}
+
+void thread_pool::worker_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        work_ready_.wait(lock, [&]{ return stop_ || !loops_.empty(); });
+        if (stop_)
+            return;
+        loop& l = *loops_.front();
+        ++l.workers;
+
+        lock.unlock();
+        run_tasks(l);
+        lock.lock();
+
+        // every task of l is taken, move on to the next loop
+        dequeue(l);
+        if (!--l.workers)
+            work_done_.notify_all();
+    }
+}
+
+void thread_pool::parallel_for(int count, const std::function<void(int)>& task)
+{
+    // loops nested in the tasks of a loop of this pool run alone on the
+    // calling thread
+    if (workers_.empty() || count < 2 || in_loop_of(this)) {
+        for (int i=0; i<count; ++i)
+            task(i);
+        return;
+    }
+
+    loop l;
+    l.task = &task;
+    l.count = count;
+    l.next = 0;
+    l.workers = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        loops_.push_back(&l);
+    }
+    work_ready_.notify_all();
+
+    run_tasks(l);
+
+    // no worker joins l once it is dequeued, wait for those which did
+    std::unique_lock<std::mutex> lock(mutex_);
+    dequeue(l);
+    work_done_.wait(lock, [&]{ return !l.workers; });
+}
+
+}
@@ -0,0 +1,64 @@
+#ifndef UNUFO_THREAD_POOL_H
+#define UNUFO_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace unufo {
+
+/// fixed set of worker threads running parallel loops,
+/// the calling thread takes part in every loop
+class thread_pool
+{
+public:
+    /// thread_count includes the calling thread, 0 means one per core
+    explicit thread_pool(int thread_count);
+    ~thread_pool();
+
+    int size() const { return workers_.size() + 1; }
+
+    /// call task(i) for every i in [0, count) and wait for completion,
+    /// the order of calls is unspecified.
+    /// Several threads may call this at once, their loops are queued and
+    /// the workers take the tasks of the oldest loop with tasks left, each
+    /// caller works on its own loop meanwhile.
+    /// Loops called from tasks of a loop of this pool run serially on the
+    /// thread of their task, loops on other pools are not affected
+    void parallel_for(int count, const std::function<void(int)>& task);
+
+private:
+    struct loop
+    {
+        const std::function<void(int)>* task;
+        int count;
+        std::atomic<int> next;
+        // workers which took tasks of the loop, guarded by mutex_
+        int workers;
+    };
+
+    void worker_loop();
+    void run_tasks(loop& l);
+    void dequeue(loop& l);
+
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable work_done_;
+
+    // loops which may have tasks left, oldest first, guarded by mutex_
+    std::deque<loop*> loops_;
+    bool stop_;
+
+    thread_pool(const thread_pool&);
+    thread_pool& operator=(const thread_pool&);
+};
+
+}
+
+#endif // UNUFO_THREAD_POOL_H
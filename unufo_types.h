@@ -1,9 +1,10 @@
 #ifndef ESYNTH_TYPES_H
 #define ESYNTH_TYPES_H
 
-#include <libgimp/gimp.h>
-#include <libgimp/gimpui.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
 
 typedef struct Coordinates
 {
@@ -24,29 +25,65 @@ typedef struct Coordinates
     }
 } Coordinates;
 
+// axis aligned rectangle, x2 and y2 are exclusive
+struct Rectangle
+{
+    int x1, y1, x2, y2;
+    Rectangle(int _x1, int _y1, int _x2, int _y2): x1(_x1), y1(_y1), x2(_x2), y2(_y2) { }
+    Rectangle(): x1(0), y1(0), x2(0), y2(0) { }
+
+    int width() const { return x2 - x1; }
+    int height() const { return y2 - y1; }
+};
+
 struct Parameters
 {
     bool invent_gradients;
     bool equal_adjustment;
     bool use_ref_layer;
 
-    gint32 corpus_id;
-
-    gint32 neighbours, tries;
-    gint32 comp_size, transfer_size;
-    gint32 max_adjustment;
+    int32_t corpus_id;
+
+    int32_t neighbours, tries;
+    int32_t comp_size, transfer_size;
+    int32_t max_adjustment;
+
+    // worker threads for the search, 0 means one per core
+    int32_t threads;
+    // refine tiles of the fill region concurrently instead of one serial scan,
+    // results don't depend on the number of threads
+    bool parallel_refinement;
+    // synthesize coarse to fine on up to this many levels, 1 means full resolution only
+    int32_t pyramid_levels;
+    // candidates taken from the patch index in the global search, 0 means random search
+    int32_t ann_candidates;
+    // seed of the random search, runs with the same seed and parameters
+    // give identical results, 0 means a new seed every run
+    int32_t seed;
+    // fill the connected parts of the selection as independent parallel jobs
+    bool split_components;
+    // milliseconds a run may take: the selection is filled first, then
+    // refined worst match first until the time is up, 0 means no limit
+    int32_t time_budget_ms;
 };
 
-//Bitmap class with three dimensions (width, height, number of channels)
+// vector kernels may read up to this many pixels past the end of a patch row,
+// so Bitmap allocations are padded by as many pixels of 4 channels
+const int simd_padding = 8;
+
+// Bitmap and Matrix index with int, the most elements one may hold,
+// larger images have to be processed a part at a time
+const int64_t max_bitmap_size = INT_MAX - simd_padding*4;
+
+//Bitmap class with three dimensions (width, height, number of channels),
+//pixels are depth consecutive elements
 template<class T>
 struct Bitmap
 {
     int width, height, depth;
     T *data;
 
-    explicit Bitmap() {
-        data = 0;
-    }
+    explicit Bitmap(): width(0), height(0), depth(0), data(0) {}
 
     ~Bitmap() {
         delete[] data;
@@ -58,52 +95,37 @@ struct Bitmap
         depth = d;
 
         delete[] data;
-        data = new T[w*h*4];
-        memset(data, 0, w*h*4);
+        data = new T[w*h*d + simd_padding*4];
+        memset(data, 0, (w*h*d + simd_padding*4)*sizeof(T));
     }
 
     T *at(int x,int y) const {
-        return data + (y*width+x)*4;
+        return data + (y*width+x)*depth;
     }
 
     T *at(const Coordinates position) const {
         return at(position.x,position.y);
     }
 
-    void to_drawable(GimpDrawable *drawable, int x1,int y1, int src_layer) {
-        int i,j;
-        GimpPixelRgn region;
-        guchar *img;
-
-        gimp_pixel_rgn_init(&region, drawable, x1,y1,width,height, TRUE,TRUE);
-
-        img = new guchar[width*height*depth];
-
-        for(i=0;i<width*height;i++)
-            for(j=0;j<int(drawable->bpp);j++)
-                img[i*drawable->bpp+j] = data[i*4+src_layer+j];
-
-        gimp_pixel_rgn_set_rect(&region, img, x1,y1,width,height);
-
-        delete[] img;
+    // copy the part of source covered by rect
+    void crop_from(const Bitmap& source, const Rectangle& rect) {
+        resize(rect.width(), rect.height(), source.depth);
+        for (int y=0; y<height; ++y)
+            memcpy(at(0, y), source.at(rect.x1, rect.y1 + y), width*depth*sizeof(T));
     }
 
-    void from_drawable(GimpDrawable *drawable, 
-            int x1,int y1, int dest_layer) {
-        int i,j;
-        GimpPixelRgn region;
-        guchar *img;
-
-        gimp_pixel_rgn_init(&region, drawable, x1,y1,width,height, FALSE,FALSE);
-
-        img = new guchar[width*height*depth];
-        gimp_pixel_rgn_get_rect(&region, img, x1,y1,width,height);
-
-        for(i=0;i<width*height;i++)
-            for(j=0;j<(int)(drawable->bpp);j++)
-                data[i*4+dest_layer+j] = img[i*drawable->bpp+j];
+    // copy whole bitmap into target with top left corner at (x1, y1)
+    void paste_to(Bitmap& target, int x1, int y1) const {
+        for (int y=0; y<height; ++y)
+            memcpy(target.at(x1, y1 + y), at(0, y), width*depth*sizeof(T));
+    }
 
-        delete[] img;
+    // exchange buffers without copying pixels
+    void swap(Bitmap& other) {
+        std::swap(width, other.width);
+        std::swap(height, other.height);
+        std::swap(depth, other.depth);
+        std::swap(data, other.data);
     }
 private:
     Bitmap(const Bitmap&);
@@ -117,7 +139,7 @@ struct Matrix
     int width, height;
     T *data;
 
-    explicit Matrix(): data(NULL) {}
+    explicit Matrix(): width(0), height(0), data(NULL) {}
 
     ~Matrix() {
         delete[] data;
@@ -128,7 +150,7 @@ struct Matrix
         height = h;
 
         delete[] data;
-        data = new T[w*h*sizeof(T)];
+        data = new T[w*h];
         memset(data, 0, w*h*sizeof(T));
     }
 
@@ -140,11 +162,170 @@ struct Matrix
         return at(position.x, position.y);
     }
 
+    void swap(Matrix& other) {
+        std::swap(width, other.width);
+        std::swap(height, other.height);
+        std::swap(data, other.data);
+    }
+
 private:
     /* don't copy me plz */
     Matrix(const Matrix<T>&);
     const Matrix& operator=(const Matrix<T>&);
 };
 
+// one bit per point, rows are padded so that the 64 bits from any
+// point of a row on can be read with two word loads
+struct BitPlane
+{
+    int width, height;
+    int stride;     // words per row
+    uint64_t *data;
+
+    explicit BitPlane(): width(0), height(0), stride(0), data(NULL) {}
+
+    ~BitPlane() {
+        delete[] data;
+    }
+
+    // all bits cleared
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        stride = (w >> 6) + 2;
+
+        delete[] data;
+        data = new uint64_t[stride*h];
+        memset(data, 0, stride*h*sizeof(uint64_t));
+    }
+
+    const uint64_t *row(int y) const {
+        return data + y*stride;
+    }
+
+    // same size and bits as source
+    void copy_from(const BitPlane& source) {
+        if (width != source.width || height != source.height)
+            resize(source.width, source.height);
+        memcpy(data, source.data, stride*height*sizeof(uint64_t));
+    }
+
+    bool get(int x, int y) const {
+        return data[y*stride + (x >> 6)] >> (x & 63) & 1;
+    }
+
+    bool get(const Coordinates& position) const {
+        return get(position.x, position.y);
+    }
+
+    // atomic, parallel refinement may define points sharing a word
+    void set(const Coordinates& position) {
+        __atomic_fetch_or(&data[position.y*stride + (position.x >> 6)],
+                uint64_t(1) << (position.x & 63), __ATOMIC_RELAXED);
+    }
+
+private:
+    BitPlane(const BitPlane&);
+    const BitPlane& operator=(const BitPlane&);
+};
+
+// PointState::flags
+const uint8_t point_selected = 1;   // point is to be filled
+const uint8_t point_held = 2;       // selected, but filled by another job
+// changed by a refinement pass with an even or odd number, shifted left
+// by the parity of the number
+const uint8_t point_changed = 4;
+
+// synthesis state of one point, everything refinement asks about a
+// neighbour in 6 bytes instead of scattered over three bitmaps
+struct PointState
+{
+    // where the point was transferred from, (0, 0) if it wasn't
+    uint16_t source_x, source_y;
+    // 255 for ground truth, copied from the source when transferred
+    uint8_t confidence;
+    uint8_t flags;
+
+    Coordinates source() const {
+        return Coordinates(source_x, source_y);
+    }
+
+    void set_source(const Coordinates& source) {
+        source_x = source.x;
+        source_y = source.y;
+    }
+
+    bool has_source() const {
+        return source_x || source_y;
+    }
+
+    bool selected() const {
+        return flags & point_selected;
+    }
+
+    bool held() const {
+        return flags & point_held;
+    }
+};
+
+static_assert(sizeof(PointState) == 6, "PointState grew, StateMap costs more per point");
+
+// largest width or height a StateMap can address sources in
+const int max_state_map_side = 65536;
+
+// PointState of every point, stored in square tiles so that the
+// neighbourhood of a point lies in a few cache lines instead of
+// one line per row
+struct StateMap
+{
+    static const int tile_shift = 3;
+    static const int tile_side = 1 << tile_shift;
+    static const int tile_mask = tile_side - 1;
+
+    int width, height;
+
+    explicit StateMap(): width(0), height(0), tiles_x(0), data(NULL) {}
+
+    ~StateMap() {
+        delete[] data;
+    }
+
+    // all points unselected, without source and confidence
+    void resize(int w, int h) {
+        width = w;
+        height = h;
+        tiles_x = (w + tile_mask) >> tile_shift;
+        int tiles_y = (h + tile_mask) >> tile_shift;
+        int size = tiles_x*tiles_y << 2*tile_shift;
+
+        delete[] data;
+        data = new PointState[size];
+        memset(data, 0, size*sizeof(PointState));
+    }
+
+    PointState *at(int x, int y) const {
+        int tile = (y >> tile_shift)*tiles_x + (x >> tile_shift);
+        return &data[(tile << 2*tile_shift) + ((y & tile_mask) << tile_shift) + (x & tile_mask)];
+    }
+
+    PointState *at(const Coordinates& position) const {
+        return at(position.x, position.y);
+    }
+
+    void swap(StateMap& other) {
+        std::swap(width, other.width);
+        std::swap(height, other.height);
+        std::swap(tiles_x, other.tiles_x);
+        std::swap(data, other.data);
+    }
+
+private:
+    int tiles_x;
+    PointState *data;
+
+    StateMap(const StateMap&);
+    const StateMap& operator=(const StateMap&);
+};
+
 #endif // ESYNTH_TYPES_H
 